@@ -18,7 +18,8 @@ include $(CLEAR_VARS)
 LOCAL_SRC_FILES := bsdiff.c
 LOCAL_MODULE := bsdiff
 LOCAL_C_INCLUDES += external/bzip2
-LOCAL_STATIC_LIBRARIES := libbz
+LOCAL_STATIC_LIBRARIES := libbsdiff libbz
+LOCAL_LDLIBS += -lpthread
 include $(BUILD_HOST_EXECUTABLE)
 
 include $(CLEAR_VARS)
@@ -26,5 +27,42 @@ include $(CLEAR_VARS)
 LOCAL_SRC_FILES := bspatch.c
 LOCAL_MODULE := bspatch
 LOCAL_C_INCLUDES += external/bzip2
-LOCAL_STATIC_LIBRARIES := libbz
+LOCAL_STATIC_LIBRARIES := libbspatch libbz
+LOCAL_LDLIBS += -lpthread
 include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := bscompose.c
+LOCAL_MODULE := bscompose
+LOCAL_C_INCLUDES += external/bzip2
+LOCAL_STATIC_LIBRARIES := libbsdiff libbspatch libbz
+LOCAL_LDLIBS += -lpthread
+include $(BUILD_HOST_EXECUTABLE)
+
+# libbsdiff and libbspatch, for making and applying patches from inside
+# another program; see bsdiff.h and bspatch.h
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := libbsdiff.c sha256.c
+LOCAL_MODULE := libbsdiff
+LOCAL_C_INCLUDES += external/bzip2
+LOCAL_EXPORT_C_INCLUDE_DIRS := $(LOCAL_PATH)
+include $(BUILD_HOST_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := libbspatch.c sha256.c
+LOCAL_MODULE := libbspatch
+LOCAL_C_INCLUDES += external/bzip2
+LOCAL_EXPORT_C_INCLUDE_DIRS := $(LOCAL_PATH)
+include $(BUILD_HOST_STATIC_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := libbspatch.c sha256.c
+LOCAL_MODULE := libbspatch
+LOCAL_C_INCLUDES += external/bzip2
+LOCAL_EXPORT_C_INCLUDE_DIRS := $(LOCAL_PATH)
+include $(BUILD_STATIC_LIBRARY)
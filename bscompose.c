@@ -0,0 +1,491 @@
+/*-
+ * Copyright 2026 The Android Open Source Project
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bsformat.h"
+#include "bsdiff.h"
+#include "bspatch.h"
+
+#define MIN(x,y) (((x)<(y)) ? (x) : (y))
+
+/*
+ * bscompose turns a patch from A to B and a patch from B to C into a
+ * patch from A to C, without A, B or C and without sorting anything;
+ * further patches, to D and so on, are taken the same way.  Given a
+ * single patch, it writes the same patch again in another format.
+ *
+ * Each byte a patch makes is the patch's own byte plus, where the patch
+ * adds to its old file, a byte of old.  Applying a patch to an empty
+ * old file leaves just the patch's bytes, its residue, and
+ * bspatch_runs() says which byte of old each byte of new adds to, if
+ * any.  So where B->C adds to B at a byte that A->B made from A, C is
+ * A plus both residues, and where either patch carries a literal, C is
+ * the residues alone.
+ */
+
+/* Largest single read or write */
+#define IO_CHUNK	(256*1024*1024)
+
+/* An input patch, mapped if possible and read whole otherwise */
+struct infile {
+	const char *name;
+	u_char *buf;
+	off_t size;
+	int mapped;
+	struct bspatch_ctx *ctx;
+};
+
+static void inload(struct infile *f)
+{
+	struct bspatch_input in;
+	off_t i,n;
+	int fd,e;
+
+	if(((fd=open(f->name,O_RDONLY,0))<0) ||
+		((f->size=lseek(fd,0,SEEK_END))==-1))
+		err(1,"%s",f->name);
+	f->mapped=0;
+	if((f->size>0) && ((size_t)f->size==f->size) &&
+		((f->buf=mmap(NULL,f->size,PROT_READ,MAP_PRIVATE,fd,0))!=
+		MAP_FAILED)) {
+		f->mapped=1;
+	} else {
+		if((f->buf=malloc(f->size+1))==NULL) err(1,NULL);
+		for(i=0;i<f->size;i+=n) {
+			if((n=pread(fd,f->buf+i,MIN(f->size-i,IO_CHUNK),i))<0) {
+				if(errno!=EINTR) err(1,"%s",f->name);
+				n=0;
+			} else if(n==0)
+				errx(1,"%s: short read",f->name);
+		};
+	};
+	if(close(fd)==-1) err(1,"%s",f->name);
+
+	memset(&in,0,sizeof(in));
+	in.buf=f->buf;
+	in.size=f->size;
+	in.mapped=f->mapped;
+	if((e=bspatch_open(&f->ctx,&in))!=0)
+		errx(1,"%s: %s",f->name,bspatch_strerror(e));
+}
+
+static void inclose(struct infile *f)
+{
+	bspatch_close(f->ctx);
+	if(f->mapped)
+		munmap(f->buf,f->size);
+	else
+		free(f->buf);
+}
+
+/* Where each byte of a patch's new comes from, as runs in order that
+	cover all of it.  Runs that copy new are resolved into the runs
+	they copy, so only BSPATCH_RUN_OLD and BSPATCH_RUN_PATCH remain */
+struct map {
+	struct bspatch_run *r;
+	off_t n,alloc;
+};
+
+static void mapadd(struct map *m,off_t newpos,off_t len,int from,off_t pos)
+{
+	struct bspatch_run *last;
+
+	last=(m->n>0)?&m->r[m->n-1]:NULL;
+	if((last!=NULL) && (last->from==from) &&
+	    ((from==BSPATCH_RUN_PATCH) || (last->pos+last->len==pos))) {
+		last->len+=len;
+		return;
+	};
+	if(m->n==m->alloc) {
+		m->alloc=m->alloc*2+1024;
+		if((m->r=realloc(m->r,m->alloc*sizeof(*m->r)))==NULL)
+			err(1,NULL);
+	};
+	m->r[m->n].newpos=newpos;
+	m->r[m->n].len=len;
+	m->r[m->n].from=from;
+	m->r[m->n].pos=pos;
+	m->n++;
+}
+
+/* The run holding pos, which must be covered */
+static struct bspatch_run mapfind(const struct map *m,off_t pos)
+{
+	off_t lo,hi,mid;
+
+	for(lo=0,hi=m->n-1;lo<hi;) {
+		mid=lo+(hi-lo+1)/2;
+		if(m->r[mid].newpos<=pos) lo=mid; else hi=mid-1;
+	};
+
+	return m->r[lo];
+}
+
+static int maprun(void *opaque,const struct bspatch_run *r)
+{
+	struct map *m=opaque;
+	struct bspatch_run q;
+	off_t done,src,k;
+
+	if(r->from!=BSPATCH_RUN_NEW) {
+		mapadd(m,r->newpos,r->len,r->from,r->pos);
+		return 0;
+	};
+
+	/* A copy may overlap itself, but each piece of it comes from
+		runs that are already there */
+	for(done=0;done<r->len;done+=k) {
+		src=r->pos+done;
+		q=mapfind(m,src);
+		k=MIN(r->len-done,q.newpos+q.len-src);
+		mapadd(m,r->newpos+done,k,q.from,
+		    (q.from==BSPATCH_RUN_OLD)?q.pos+(src-q.newpos):0);
+	};
+
+	return 0;
+}
+
+static void mapbuild(struct map *m,struct infile *f)
+{
+	int e;
+
+	memset(m,0,sizeof(*m));
+	if((e=bspatch_runs(f->ctx,maprun,m))!=0)
+		errx(1,"%s: %s",f->name,bspatch_strerror(e));
+}
+
+/* A version made from A by the patches so far: where each byte of it
+	comes from, in runs of A or of the patches, and its residue */
+struct version {
+	struct map m;
+	u_char *res;
+	off_t size;
+};
+
+/* What a patch makes from an empty old */
+static u_char *residue(struct infile *f)
+{
+	static const u_char empty[1];
+	struct bspatch_input old;
+	struct bspatch_output out;
+	struct bspatch_opts opts;
+	u_char *buf;
+	int e;
+
+	if((buf=malloc(bspatch_newsize(f->ctx)+1))==NULL)
+		err(1,NULL);
+	memset(&old,0,sizeof(old));
+	old.buf=empty;
+	memset(&out,0,sizeof(out));
+	out.buf=buf;
+	memset(&opts,0,sizeof(opts));
+	opts.hi=-1;
+	opts.noverify=BSPATCH_NOVERIFY_OLD|BSPATCH_NOVERIFY_NEW;
+	if((e=bspatch_apply(f->ctx,&old,&out,&opts))!=0)
+		errx(1,"%s: %s",f->name,bspatch_strerror(e));
+
+	return buf;
+}
+
+/* Take v on through the patch f */
+static void compose(struct version *v,struct infile *f)
+{
+	struct map m,nm;
+	struct bspatch_run q,p;
+	u_char *res;
+	off_t i,j,done,b,k;
+
+	mapbuild(&m,f);
+	res=residue(f);
+
+	/* Follow each run of the new version back through v to A, adding
+		v's residue where the patch adds to v */
+	memset(&nm,0,sizeof(nm));
+	for(i=0;i<m.n;i++) {
+		q=m.r[i];
+		if(q.from==BSPATCH_RUN_PATCH) {
+			mapadd(&nm,q.newpos,q.len,BSPATCH_RUN_PATCH,0);
+			continue;
+		};
+		for(done=0;done<q.len;done+=k) {
+			b=q.pos+done;
+			if((b<0) || (b>=v->size)) {
+				/* Outside v, which adds nothing */
+				k=(b<0)?MIN(q.len-done,-b):q.len-done;
+				mapadd(&nm,q.newpos+done,k,BSPATCH_RUN_PATCH,0);
+				continue;
+			};
+			p=mapfind(&v->m,b);
+			k=MIN(q.len-done,p.newpos+p.len-b);
+			for(j=0;j<k;j++)
+				res[q.newpos+done+j]+=v->res[b+j];
+			mapadd(&nm,q.newpos+done,k,p.from,
+			    (p.from==BSPATCH_RUN_OLD)?p.pos+(b-p.newpos):0);
+		};
+	};
+
+	free(m.r);
+	free(v->m.r);
+	free(v->res);
+	v->m=nm;
+	v->res=res;
+	v->size=bspatch_newsize(f->ctx);
+}
+
+/* The composed patch's triples, built up a piece at a time */
+struct triples {
+	struct bsdiff_triple *t;
+	off_t n,alloc;
+};
+
+/* Append len bytes made from old from oldpos on, or with oldpos<0
+	carried as extra bytes */
+static void piece(struct triples *ts,off_t len,off_t oldpos)
+{
+	struct bsdiff_triple *last;
+
+	last=(ts->n>0)?&ts->t[ts->n-1]:NULL;
+	if((oldpos<0) && (last!=NULL)) {
+		last->extra+=len;
+		return;
+	};
+	if((oldpos>=0) && (last!=NULL) && (last->extra==0) &&
+	    (last->oldpos+last->lenf==oldpos)) {
+		last->lenf+=len;
+		return;
+	};
+	if(ts->n==ts->alloc) {
+		ts->alloc=ts->alloc*2+1024;
+		if((ts->t=realloc(ts->t,ts->alloc*sizeof(*ts->t)))==NULL)
+			err(1,NULL);
+	};
+	last=&ts->t[ts->n++];
+	last->oldpos=(oldpos<0)?0:oldpos;
+	last->lenf=(oldpos<0)?0:len;
+	last->extra=(oldpos<0)?len:0;
+}
+
+/* The output patch, written through bsdiff_write()'s callback.  A pipe
+	can only be written in order, which a -p patch is */
+struct patchfile {
+	const char *name;
+	int fd;
+	int pipe;
+	off_t pos;
+};
+
+static int patchwrite(void *opaque,off_t pos,const u_char *buf,size_t len)
+{
+	struct patchfile *pf=opaque;
+	size_t i;
+	ssize_t n;
+
+	if(pf->pipe && (pos!=pf->pos))
+		errx(1,"%s: cannot seek",pf->name);
+	for(i=0;i<len;i+=n) {
+		if(pf->pipe)
+			n=write(pf->fd,buf+i,MIN(len-i,IO_CHUNK));
+		else
+			n=pwrite(pf->fd,buf+i,MIN(len-i,IO_CHUNK),pos+i);
+		if(n<0) {
+			if(errno!=EINTR) err(1,"%s",pf->name);
+			n=0;
+		};
+	};
+	pf->pos=pos+len;
+
+	return 0;
+}
+
+/* Parse a size with an optional k, m or g suffix */
+static off_t parsesize(const char *str)
+{
+	char *end;
+	off_t x;
+
+	x=strtoll(str,&end,10);
+	switch(*end) {
+	case 'g': case 'G': x*=1024;
+	/* FALLTHROUGH */
+	case 'm': case 'M': x*=1024;
+	/* FALLTHROUGH */
+	case 'k': case 'K': x*=1024;
+		end++;
+	};
+	if((end==str) || (*end!='\0') || (x<=0))
+		errx(1,"invalid size: %s",str);
+
+	return x;
+}
+
+static void usage(void)
+{
+	errx(1,"usage: bscompose [-cdnopz] [-s segsize] patch1 [patch2 ...] "
+	    "patchfile\n");
+}
+
+int main(int argc,char *argv[])
+{
+	struct infile *ps;
+	struct version v;
+	struct triples ts;
+	struct bsdiff_opts opts;
+	struct bsdiff_output out;
+	struct patchfile pf;
+	struct stat sb;
+	struct bspatch_run r;
+	const u_char *d,*dprev;
+	u_char digest[BSDIGEST_LEN];
+	off_t i,k;
+	int ch,n,e;
+
+	memset(&opts,0,sizeof(opts));
+	while((ch=getopt(argc,argv,"cdnops:z"))!=-1) {
+		switch(ch) {
+		case 'c':
+			opts.flags|=BSDF_COLUMNS;
+			break;
+		case 'd':
+			opts.flags|=BSDF_DIGEST;
+			break;
+		case 'n':
+			opts.compact=1;
+			break;
+		case 'o':
+			opts.flags|=BSDF_OPS;
+			break;
+		case 'p':
+			opts.flags|=BSDF_SEGMENTS|BSDF_STREAM;
+			break;
+		case 's':
+			opts.segsize=parsesize(optarg);
+			opts.flags|=BSDF_SEGMENTS;
+			break;
+		case 'z':
+			opts.flags|=BSDF_SPARSE;
+			break;
+		default:
+			usage();
+		};
+	};
+	argc-=optind;
+	argv+=optind;
+	if(argc<2) usage();
+	n=argc-1;
+
+	/* Patches with digests say whether they follow on, and -d carries
+		A's digest from the first and the last version's from the
+		last */
+	if((ps=calloc(n,sizeof(*ps)))==NULL) err(1,NULL);
+	dprev=NULL;
+	for(i=0;i<n;i++) {
+		ps[i].name=argv[i];
+		inload(&ps[i]);
+		d=bspatch_digest(ps[i].ctx);
+		if((opts.flags&BSDF_DIGEST) && (d==NULL))
+			errx(1,"-d needs patches made with bsdiff -d");
+		if((d!=NULL) && (dprev!=NULL) &&
+		    (memcmp(dprev+BSDIGEST_LEN/2,d,BSDIGEST_LEN/2)!=0))
+			errx(1,"%s does not apply to what %s makes",
+			    ps[i].name,ps[i-1].name);
+		dprev=d;
+	};
+	if(opts.flags&BSDF_DIGEST) {
+		memcpy(digest,bspatch_digest(ps[0].ctx),BSDIGEST_LEN/2);
+		memcpy(digest+BSDIGEST_LEN/2,
+		    bspatch_digest(ps[n-1].ctx)+BSDIGEST_LEN/2,BSDIGEST_LEN/2);
+	};
+
+	mapbuild(&v.m,&ps[0]);
+	v.res=residue(&ps[0]);
+	v.size=bspatch_newsize(ps[0].ctx);
+	for(i=1;i<n;i++)
+		compose(&v,&ps[i]);
+
+	/* A run that starts before A reads zeros there, so that part is
+		carried as extra bytes and the rest is added to A */
+	memset(&ts,0,sizeof(ts));
+	for(i=0;i<v.m.n;i++) {
+		r=v.m.r[i];
+		if(r.from!=BSPATCH_RUN_OLD) {
+			piece(&ts,r.len,-1);
+			continue;
+		};
+		if(r.pos<0) {
+			k=MIN(r.len,-r.pos);
+			piece(&ts,k,-1);
+			r.len-=k;
+			r.pos=0;
+		};
+		if(r.len>0)
+			piece(&ts,r.len,r.pos);
+	};
+
+	/* Create the patch file, or with "-" write to stdout */
+	pf.name=argv[n];
+	if(strcmp(pf.name,"-")==0) {
+		pf.name="stdout";
+		pf.fd=STDOUT_FILENO;
+	} else if((pf.fd=open(pf.name,O_CREAT|O_TRUNC|O_WRONLY,0666))<0)
+		err(1,"%s",pf.name);
+	if(fstat(pf.fd,&sb)==-1)
+		err(1,"%s",pf.name);
+	pf.pipe=!S_ISREG(sb.st_mode);
+	pf.pos=0;
+	memset(&out,0,sizeof(out));
+	out.write=patchwrite;
+	out.opaque=&pf;
+	if(pf.pipe && !(opts.flags&BSDF_STREAM))
+		out.write=NULL;
+
+	if((e=bsdiff_write(ts.t,ts.n,v.res,v.size,digest,&opts,&out))!=0)
+		errx(1,"%s",bsdiff_strerror(e));
+	if(out.write==NULL) {
+		patchwrite(&pf,0,out.buf,out.len);
+		free(out.buf);
+	};
+	if(close(pf.fd)==-1)
+		err(1,"%s",pf.name);
+
+	free(ts.t);
+	free(v.res);
+	free(v.m.r);
+	for(i=0;i<n;i++)
+		inclose(&ps[i]);
+	free(ps);
+
+	return 0;
+}
@@ -29,150 +29,157 @@ __FBSDID("$FreeBSD: src/usr.bin/bsdiff/bsdiff/bsdiff.c,v 1.1 2005/08/06 01:59:05
 #endif
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#include <bzlib.h>
+#include <dirent.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-#define MIN(x,y) (((x)<(y)) ? (x) : (y))
+#include <bzlib.h>
 
-static void split(off_t *I,off_t *V,off_t start,off_t len,off_t h)
-{
-	off_t i,j,k,x,tmp,jj,kk;
-
-	if(len<16) {
-		for(k=start;k<start+len;k+=j) {
-			j=1;x=V[I[k]+h];
-			for(i=1;k+i<start+len;i++) {
-				if(V[I[k+i]+h]<x) {
-					x=V[I[k+i]+h];
-					j=0;
-				};
-				if(V[I[k+i]+h]==x) {
-					tmp=I[k+j];I[k+j]=I[k+i];I[k+i]=tmp;
-					j++;
-				};
-			};
-			for(i=0;i<j;i++) V[I[k+i]]=k+j-1;
-			if(j==1) I[k]=-1;
-		};
-		return;
-	};
+#include "bsformat.h"
+#include "bsdiff.h"
 
-	x=V[I[start+len/2]+h];
-	jj=0;kk=0;
-	for(i=start;i<start+len;i++) {
-		if(V[I[i]+h]<x) jj++;
-		if(V[I[i]+h]==x) kk++;
-	};
-	jj+=start;kk+=jj;
-
-	i=start;j=0;k=0;
-	while(i<jj) {
-		if(V[I[i]+h]<x) {
-			i++;
-		} else if(V[I[i]+h]==x) {
-			tmp=I[i];I[i]=I[jj+j];I[jj+j]=tmp;
-			j++;
-		} else {
-			tmp=I[i];I[i]=I[kk+k];I[kk+k]=tmp;
-			k++;
-		};
-	};
+#define MIN(x,y) (((x)<(y)) ? (x) : (y))
 
-	while(jj+j<kk) {
-		if(V[I[jj+j]+h]==x) {
-			j++;
-		} else {
-			tmp=I[jj+j];I[jj+j]=I[kk+k];I[kk+k]=tmp;
-			k++;
-		};
-	};
+/* How much longer than carrying on in place a match must be for a diff
+	in a bundle to jump to it.  The old files of a tree share so many
+	short strings that bsdiff's usual 8 bytes makes diffs hop between
+	unrelated files, costing more in seeks than they save */
+#define BUNDLE_MINJUMP	32
+
+/* An input file, mapped if possible and read in chunks otherwise */
+struct infile {
+	const char *name;
+	u_char *buf;
+	off_t size;
+	int mapped;
+};
 
-	if(jj>start) split(I,V,start,jj-start,h);
+/* Largest single read when an input cannot be mapped */
+#define IN_CHUNK	(256*1024*1024)
 
-	for(i=0;i<kk-jj;i++) V[I[jj+i]]=kk-1;
-	if(jj==kk-1) I[jj]=-1;
+/* Read the first size bytes of fd, open as name, into buf */
+static void readall(int fd,const char *name,u_char *buf,off_t size)
+{
+	off_t i,n;
 
-	if(start+len>kk) split(I,V,kk,start+len-kk,h);
+	for(i=0;i<size;i+=n) {
+		if((n=pread(fd,buf+i,MIN(size-i,IN_CHUNK),i))<0) {
+			if(errno!=EINTR) err(1,"%s",name);
+			n=0;
+		} else if(n==0)
+			errx(1,"%s: short read",name);
+	};
 }
 
-static void qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize)
+/* Open f->name and bring all of it into memory */
+static void inload(struct infile *f)
 {
-	off_t buckets[256];
-	off_t i,h,len;
-
-	for(i=0;i<256;i++) buckets[i]=0;
-	for(i=0;i<oldsize;i++) buckets[old[i]]++;
-	for(i=1;i<256;i++) buckets[i]+=buckets[i-1];
-	for(i=255;i>0;i--) buckets[i]=buckets[i-1];
-	buckets[0]=0;
+	off_t i;
+	long pagesize;
+	volatile u_char sum;
+	int fd;
 
-	for(i=0;i<oldsize;i++) I[++buckets[old[i]]]=i;
-	I[0]=oldsize;
-	for(i=0;i<oldsize;i++) V[i]=buckets[old[i]];
-	V[oldsize]=0;
-	for(i=1;i<256;i++) if(buckets[i]==buckets[i-1]+1) I[buckets[i]]=-1;
-	I[0]=-1;
+	if(((fd=open(f->name,O_RDONLY,0))<0) ||
+		((f->size=lseek(fd,0,SEEK_END))==-1))
+		err(1,"%s",f->name);
 
-	for(h=1;I[0]!=-(oldsize+1);h+=h) {
-		len=0;
-		for(i=0;i<oldsize+1;) {
-			if(I[i]<0) {
-				len-=I[i];
-				i-=I[i];
-			} else {
-				if(len) I[i-len]=-len;
-				len=V[I[i]]+1-i;
-				split(I,V,i,len,h);
-				i+=len;
-				len=0;
-			};
-		};
-		if(len) I[i-len]=-len;
+	f->mapped=0;
+	if((f->size>0) && ((size_t)f->size==f->size) &&
+		((f->buf=mmap(NULL,f->size,PROT_READ,MAP_PRIVATE,fd,0))!=
+		MAP_FAILED)) {
+		/* Both inputs are read all over by the sort and the scan,
+			so ask for huge pages and fault everything in now */
+#ifdef MADV_HUGEPAGE
+		madvise(f->buf,f->size,MADV_HUGEPAGE);
+#endif
+		madvise(f->buf,f->size,MADV_WILLNEED);
+		pagesize=sysconf(_SC_PAGESIZE);
+		for(i=0,sum=0;i<f->size;i+=pagesize)
+			sum+=f->buf[i];
+		f->mapped=1;
+	} else {
+		/* Allocate size+1 bytes instead of size bytes to ensure
+			that we never try to malloc(0) and get a NULL pointer */
+		if((f->buf=malloc(f->size+1))==NULL) err(1,NULL);
+		readall(fd,f->name,f->buf,f->size);
 	};
+	if(close(fd)==-1) err(1,"%s",f->name);
+}
 
-	for(i=0;i<oldsize+1;i++) I[V[i]]=i;
+static void *inloadthread(void *arg)
+{
+	inload(arg);
+	return NULL;
 }
 
-static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
+static void inclose(struct infile *f)
 {
-	off_t i;
+	if(f->mapped)
+		munmap(f->buf,f->size);
+	else
+		free(f->buf);
+}
+
+/* The patch file, written through bsdiff_diff()'s output callback.
+	A pipe can only be written in order, which a -p patch is */
+struct patchfile {
+	const char *name;
+	int fd;
+	int pipe;
+	off_t pos;		/* Where a pipe has got to */
+};
 
-	for(i=0;(i<oldsize)&&(i<newsize);i++)
-		if(old[i]!=new[i]) break;
+static int patchwrite(void *opaque,off_t pos,const u_char *buf,size_t len)
+{
+	struct patchfile *pf=opaque;
+	size_t i;
+	ssize_t n;
+
+	if(pf->pipe && (pos!=pf->pos))
+		errx(1,"%s: cannot seek",pf->name);
+	for(i=0;i<len;i+=n) {
+		if(pf->pipe)
+			n=write(pf->fd,buf+i,MIN(len-i,IN_CHUNK));
+		else
+			n=pwrite(pf->fd,buf+i,MIN(len-i,IN_CHUNK),pos+i);
+		if(n<0) {
+			if(errno!=EINTR) err(1,"%s",pf->name);
+			n=0;
+		};
+	};
+	pf->pos=pos+len;
 
-	return i;
+	return 0;
 }
 
-static off_t search(off_t *I,u_char *old,off_t oldsize,
-		u_char *new,off_t newsize,off_t st,off_t en,off_t *pos)
+/* Parse a size with an optional k, m or g suffix */
+static off_t parsesize(const char *str)
 {
-	off_t x,y;
-
-	if(en-st<2) {
-		x=matchlen(old+I[st],oldsize-I[st],new,newsize);
-		y=matchlen(old+I[en],oldsize-I[en],new,newsize);
+	char *end;
+	off_t x;
 
-		if(x>y) {
-			*pos=I[st];
-			return x;
-		} else {
-			*pos=I[en];
-			return y;
-		}
+	x=strtoll(str,&end,10);
+	switch(*end) {
+	case 'g': case 'G': x*=1024;
+	/* FALLTHROUGH */
+	case 'm': case 'M': x*=1024;
+	/* FALLTHROUGH */
+	case 'k': case 'K': x*=1024;
+		end++;
 	};
+	if((end==str) || (*end!='\0') || (x<=0))
+		errx(1,"invalid size: %s",str);
 
-	x=st+(en-st)/2;
-	if(memcmp(old+I[x],new,MIN(oldsize-I[x],newsize))<0) {
-		return search(I,old,oldsize,new,newsize,x,en,pos);
-	} else {
-		return search(I,old,oldsize,new,newsize,st,x,pos);
-	};
+	return x;
 }
 
 static void offtout(off_t x,u_char *buf)
@@ -193,212 +200,1058 @@ static void offtout(off_t x,u_char *buf)
 	if(x<0) buf[7]|=0x80;
 }
 
-int main(int argc,char *argv[])
+/* A batch of new files to diff against the same old, from -b: each
+	line of the manifest names a new file and the patch to write for
+	it.  Workers take the next pair as they finish the last */
+struct batch {
+	const struct bsdiff_index *idx;
+	const struct bsdiff_opts *opts;
+	char *text;		/* The manifest, which names point into */
+	char **names;		/* new, patch, new, patch, ... */
+	struct bsdiff_output *outs;	/* With -B, where the patches go
+					   instead of to files */
+	size_t n,next;
+	pthread_mutex_t lock;
+};
+
+/* Read the manifest into b->names */
+static void batchload(struct batch *b,const char *fname)
 {
-	int fd;
-	u_char *old,*new;
-	off_t oldsize,newsize;
-	off_t *I,*V;
-	off_t scan,pos,len;
-	off_t lastscan,lastpos,lastoffset;
-	off_t oldscore,scsc;
-	off_t s,Sf,lenf,Sb,lenb;
-	off_t overlap,Ss,lens;
-	off_t i;
-	off_t dblen,eblen;
-	u_char *db,*eb;
-	u_char buf[8];
-	u_char header[32];
-	FILE * pf;
-	BZFILE * pfbz2;
-	int bz2err;
-
-	if(argc!=4) errx(1,"usage: %s oldfile newfile patchfile\n",argv[0]);
-
-	/* Allocate oldsize+1 bytes instead of oldsize bytes to ensure
-		that we never try to malloc(0) and get a NULL pointer */
-	if(((fd=open(argv[1],O_RDONLY,0))<0) ||
-		((oldsize=lseek(fd,0,SEEK_END))==-1) ||
-		((old=malloc(oldsize+1))==NULL) ||
-		(lseek(fd,0,SEEK_SET)!=0) ||
-		(read(fd,old,oldsize)!=oldsize) ||
-		(close(fd)==-1)) err(1,"%s",argv[1]);
-
-	if(((I=malloc((oldsize+1)*sizeof(off_t)))==NULL) ||
-		((V=malloc((oldsize+1)*sizeof(off_t)))==NULL)) err(1,NULL);
-
-	qsufsort(I,V,old,oldsize);
-
-	free(V);
-
-	/* Allocate newsize+1 bytes instead of newsize bytes to ensure
-		that we never try to malloc(0) and get a NULL pointer */
-	if(((fd=open(argv[2],O_RDONLY,0))<0) ||
-		((newsize=lseek(fd,0,SEEK_END))==-1) ||
-		((new=malloc(newsize+1))==NULL) ||
-		(lseek(fd,0,SEEK_SET)!=0) ||
-		(read(fd,new,newsize)!=newsize) ||
-		(close(fd)==-1)) err(1,"%s",argv[2]);
-
-	if(((db=malloc(newsize+1))==NULL) ||
-		((eb=malloc(newsize+1))==NULL)) err(1,NULL);
-	dblen=0;
-	eblen=0;
-
-	/* Create the patch file */
-	if ((pf = fopen(argv[3], "w")) == NULL)
-		err(1, "%s", argv[3]);
-
-	/* Header is
-		0	8	 "BSDIFF40"
-		8	8	length of bzip2ed ctrl block
-		16	8	length of bzip2ed diff block
-		24	8	length of new file */
-	/* File is
-		0	32	Header
-		32	??	Bzip2ed ctrl block
-		??	??	Bzip2ed diff block
-		??	??	Bzip2ed extra block */
-	memcpy(header,"BSDIFF40",8);
-	offtout(0, header + 8);
-	offtout(0, header + 16);
-	offtout(newsize, header + 24);
-	if (fwrite(header, 32, 1, pf) != 1)
-		err(1, "fwrite(%s)", argv[3]);
-
-	/* Compute the differences, writing ctrl as we go */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	scan=0;len=0;
-	lastscan=0;lastpos=0;lastoffset=0;
-	while(scan<newsize) {
-		oldscore=0;
-
-		for(scsc=scan+=len;scan<newsize;scan++) {
-			len=search(I,old,oldsize,new+scan,newsize-scan,
-					0,oldsize,&pos);
-
-			for(;scsc<scan+len;scsc++)
-			if((scsc+lastoffset<oldsize) &&
-				(old[scsc+lastoffset] == new[scsc]))
-				oldscore++;
-
-			if(((len==oldscore) && (len!=0)) || 
-				(len>oldscore+8)) break;
-
-			if((scan+lastoffset<oldsize) &&
-				(old[scan+lastoffset] == new[scan]))
-				oldscore--;
+	struct infile f;
+	char *p,*tok;
+	size_t alloc;
+
+	f.name=fname;
+	inload(&f);
+	if((b->text=p=malloc(f.size+1))==NULL) err(1,NULL);
+	memcpy(p,f.buf,f.size);
+	p[f.size]='\0';
+	inclose(&f);
+
+	b->names=NULL;
+	b->n=alloc=0;
+	for(;(tok=strsep(&p," \t\n"))!=NULL;) {
+		if(*tok=='\0') continue;
+		if(b->n==alloc) {
+			alloc=alloc*2+64;
+			if((b->names=realloc(b->names,
+			    alloc*sizeof(*b->names)))==NULL)
+				err(1,NULL);
 		};
+		b->names[b->n++]=tok;
+	};
+	if(b->n%2!=0)
+		errx(1,"%s: %s has no patch file",fname,b->names[b->n-1]);
+	b->n/=2;
+}
 
-		if((len!=oldscore) || (scan==newsize)) {
-			s=0;Sf=0;lenf=0;
-			for(i=0;(lastscan+i<scan)&&(lastpos+i<oldsize);) {
-				if(old[lastpos+i]==new[lastscan+i]) s++;
-				i++;
-				if(s*2-i>Sf*2-lenf) { Sf=s; lenf=i; };
-			};
+/* Diff the new file named by new against the index into a patch file,
+	or if mem is not NULL into memory, where patch only names it */
+static void diffone(const struct bsdiff_index *idx,
+	const struct bsdiff_opts *opts,const char *new,const char *patch,
+	struct bsdiff_output *mem)
+{
+	struct infile newf;
+	struct bsdiff_output out;
+	struct patchfile pf;
+	int e;
 
-			lenb=0;
-			if(scan<newsize) {
-				s=0;Sb=0;
-				for(i=1;(scan>=lastscan+i)&&(pos>=i);i++) {
-					if(old[pos-i]==new[scan-i]) s++;
-					if(s*2-i>Sb*2-lenb) { Sb=s; lenb=i; };
-				};
-			};
+	newf.name=new;
+	inload(&newf);
+	memset(&out,0,sizeof(out));
+	if(mem==NULL) {
+		pf.name=patch;
+		if((pf.fd=open(pf.name,O_CREAT|O_TRUNC|O_WRONLY,0666))<0)
+			err(1,"%s",pf.name);
+		pf.pipe=0;
+		pf.pos=0;
+		out.write=patchwrite;
+		out.opaque=&pf;
+	};
+	if((e=bsdiff_diff(idx,newf.buf,newf.size,opts,&out))!=0)
+		errx(1,"%s: %s",patch,bsdiff_strerror(e));
+	if(mem!=NULL)
+		*mem=out;
+	else if(close(pf.fd)==-1)
+		err(1,"%s",pf.name);
+	inclose(&newf);
+}
+
+static void *batchworker(void *arg)
+{
+	struct batch *b=arg;
+	size_t i;
+
+	for(;;) {
+		pthread_mutex_lock(&b->lock);
+		i=b->next++;
+		pthread_mutex_unlock(&b->lock);
+		if(i>=b->n) break;
+		diffone(b->idx,b->opts,b->names[2*i],b->names[2*i+1],
+		    (b->outs!=NULL)?&b->outs[i]:NULL);
+	};
+
+	return NULL;
+}
+
+/* Run worker(arg) on up to threads threads, or on this one */
+static void workers(void *(*worker)(void *),void *arg,int threads)
+{
+	pthread_t *t;
+	int i;
 
-			if(lastscan+lenf>scan-lenb) {
-				overlap=(lastscan+lenf)-(scan-lenb);
-				s=0;Ss=0;lens=0;
-				for(i=0;i<overlap;i++) {
-					if(new[lastscan+lenf-overlap+i]==
-					   old[lastpos+lenf-overlap+i]) s++;
-					if(new[scan-lenb+i]==
-					   old[pos-lenb+i]) s--;
-					if(s>Ss) { Ss=s; lens=i+1; };
-				};
-
-				lenf+=lens-overlap;
-				lenb-=lens;
+	if(threads<=1) {
+		worker(arg);
+		return;
+	};
+	if((t=malloc(threads*sizeof(*t)))==NULL) err(1,NULL);
+	for(i=0;i<threads;i++)
+		if((errno=pthread_create(&t[i],NULL,worker,arg))!=0)
+			err(1,"pthread_create");
+	for(i=0;i<threads;i++)
+		if((errno=pthread_join(t[i],NULL))!=0)
+			err(1,"pthread_join");
+	free(t);
+}
+
+/* Diff every pair in the manifest against the one index, on up to
+	threads threads */
+static void batchrun(struct batch *b,int threads)
+{
+	if((errno=pthread_mutex_init(&b->lock,NULL))!=0)
+		err(1,"pthread_mutex_init");
+	b->next=0;
+	workers(batchworker,b,MIN((size_t)threads,b->n));
+	pthread_mutex_destroy(&b->lock);
+}
+
+/* The regular files under a directory, from -B, by name relative to
+	it.  Other kinds of file are left out */
+struct tree {
+	const char *root;
+	char **names;
+	off_t *sizes;
+	size_t n,alloc;
+};
+
+/* Return a malloc'd "dir/name", or name alone if dir is empty */
+static char *pathjoin(const char *dir,const char *name)
+{
+	char *p;
+
+	if((p=malloc(strlen(dir)+strlen(name)+2))==NULL) err(1,NULL);
+	if(*dir=='\0')
+		strcpy(p,name);
+	else
+		sprintf(p,"%s/%s",dir,name);
+
+	return p;
+}
+
+/* Add the files under dir, relative to t->root, to t */
+static void treewalk(struct tree *t,const char *dir)
+{
+	DIR *d;
+	struct dirent *de;
+	struct stat sb;
+	char *path,*rel,*full;
+
+	path=pathjoin(t->root,dir);
+	if((d=opendir(path))==NULL)
+		err(1,"%s",path);
+	while((errno=0,de=readdir(d))!=NULL) {
+		if((strcmp(de->d_name,".")==0) || (strcmp(de->d_name,"..")==0))
+			continue;
+		rel=pathjoin(dir,de->d_name);
+		full=pathjoin(t->root,rel);
+		if(lstat(full,&sb)==-1)
+			err(1,"%s",full);
+		if(S_ISDIR(sb.st_mode)) {
+			treewalk(t,rel);
+			free(rel);
+		} else if(S_ISREG(sb.st_mode)) {
+			if(t->n==t->alloc) {
+				t->alloc=t->alloc*2+64;
+				if((t->names=realloc(t->names,
+				    t->alloc*sizeof(*t->names)))==NULL)
+					err(1,NULL);
 			};
+			t->names[t->n++]=rel;
+		} else
+			free(rel);
+		free(full);
+	};
+	if(errno!=0)
+		err(1,"%s",path);
+	closedir(d);
+	free(path);
+}
+
+static int namecmp(const void *a,const void *b)
+{
+	return strcmp(*(char *const *)a,*(char *const *)b);
+}
+
+/* List the files under root in t, in name order so that a bundle does
+	not depend on the order of directory entries */
+static void treeload(struct tree *t,const char *root)
+{
+	memset(t,0,sizeof(*t));
+	t->root=root;
+	treewalk(t,"");
+	if(t->n>0)
+		qsort(t->names,t->n,sizeof(*t->names),namecmp);
+	if((t->sizes=calloc(t->n+1,sizeof(*t->sizes)))==NULL)
+		err(1,NULL);
+}
+
+static void treefree(struct tree *t)
+{
+	size_t i;
+
+	for(i=0;i<t->n;i++)
+		free(t->names[i]);
+	free(t->names);
+	free(t->sizes);
+}
+
+/* Append one manifest entry to buf, returning its length; base is
+	only written for new files, being NULL for old ones */
+static size_t manifestentry(u_char *buf,off_t size,const off_t *base,
+	const char *name)
+{
+	size_t len,n;
+
+	len=strlen(name);
+	offtout(size,buf);
+	n=8;
+	if(base!=NULL) {
+		offtout(*base,buf+n);
+		n+=8;
+	};
+	offtout(len,buf+n);
+	memcpy(buf+n+8,name,len);
+
+	return n+8+len;
+}
+
+/*
+ * With -m, each new file is diffed against the one old file that shares
+ * the most of its content, found from sketches of the files rather than
+ * by diffing, so that thousands of files can be matched in a few
+ * seconds.  A sketch is a sample of the fingerprints of the 64-byte
+ * windows of a file: a gear hash is rolled over the file, and the
+ * fingerprints at the roughly one position in 2^SKETCH_BITS where its
+ * top SKETCH_BITS bits are zero are kept.  The choice depends only on
+ * the content of the window, so a window common to two files is sampled
+ * in both, and the share of a new file's samples found in an old file
+ * estimates how much of the new file could be copied from it, however
+ * the old file is named and whatever else it holds.
+ */
+#define SKETCH_BITS	7
+
+/* New files with fewer than this percentage of their samples in any old
+	file are diffed against the old file at the same path, if there is
+	one, and otherwise against nothing, since sorting an old file they
+	have so little in common with would hardly shrink their patches */
+#define MATCH_PERCENT	10
+
+/* The fingerprints sampled from one file, each once */
+struct sketch {
+	u_int64_t *h;
+	size_t n,alloc;
+};
+
+/* The sketches of all the old files, as samples chained together by
+	fingerprint from an open hash table */
+struct sample {
+	u_int64_t h;
+	u_int32_t file;
+	u_int32_t next;		/* Index+1 of the previous sample of h */
+};
+
+struct sketchidx {
+	struct sample *s;
+	size_t n,alloc;
+	u_int32_t *table;	/* Index+1 of the last sample of each h */
+	size_t nslot,used;
+	int bits;
+};
+
+/* Slot for fingerprint h in a table of 2^bits slots */
+#define SLOT(h,bits)	(((h)*0x9E3779B97F4A7C15ULL)>>(64-(bits)))
+
+static u_int64_t gear[256];
+
+/* Fill gear[] with the same pseudo-random values on every run */
+static void gearinit(void)
+{
+	u_int64_t x,z;
+	int i;
+
+	for(i=0,x=0;i<256;i++) {
+		z=(x+=0x9E3779B97F4A7C15ULL);
+		z=(z^(z>>30))*0xBF58476D1CE4E5B9ULL;
+		z=(z^(z>>27))*0x94D049BB133111EBULL;
+		gear[i]=z^(z>>31);
+	};
+}
+
+static int fpcmp(const void *a,const void *b)
+{
+	u_int64_t x=*(const u_int64_t *)a,y=*(const u_int64_t *)b;
+
+	return (x<y)?-1:(x>y);
+}
+
+/* Set sk to the sketch of buf */
+static void sketch(struct sketch *sk,const u_char *buf,off_t size)
+{
+	u_int64_t h;
+	off_t i;
+	size_t j,k;
+
+	sk->n=0;
+	for(i=0,h=0;i<size;i++) {
+		h=(h<<1)+gear[buf[i]];
+		if((h>>(64-SKETCH_BITS)!=0) || (i<63))
+			continue;
+		if(sk->n==sk->alloc) {
+			sk->alloc=sk->alloc*2+1024;
+			if((sk->h=realloc(sk->h,sk->alloc*sizeof(*sk->h)))==NULL)
+				err(1,NULL);
+		};
+		sk->h[sk->n++]=h;
+	};
+	if(sk->n==0) return;
+	qsort(sk->h,sk->n,sizeof(*sk->h),fpcmp);
+	for(j=k=1;j<sk->n;j++)
+		if(sk->h[j]!=sk->h[k-1])
+			sk->h[k++]=sk->h[j];
+	sk->n=k;
+}
 
-			for(i=0;i<lenf;i++)
-				db[dblen+i]=new[lastscan+i]-old[lastpos+i];
-			for(i=0;i<(scan-lenb)-(lastscan+lenf);i++)
-				eb[eblen+i]=new[lastscan+lenf+i];
+/* Set sk to the sketch of the file of t numbered file, read through
+	*buf, which is grown as needed to *alloc bytes */
+static void sketchfile(struct sketch *sk,const struct tree *t,size_t file,
+	u_char **buf,off_t *alloc)
+{
+	struct stat sb;
+	char *path;
+	int fd;
+
+	path=pathjoin(t->root,t->names[file]);
+	if(((fd=open(path,O_RDONLY,0))<0) || (fstat(fd,&sb)==-1))
+		err(1,"%s",path);
+	if(sb.st_size>*alloc) {
+		*alloc=sb.st_size;
+		if((*buf=realloc(*buf,*alloc))==NULL) err(1,NULL);
+	};
+	readall(fd,path,*buf,sb.st_size);
+	if(close(fd)==-1) err(1,"%s",path);
+	sketch(sk,*buf,sb.st_size);
+	free(path);
+}
+
+/* The table slot that holds h, or the empty one where it would go */
+static u_int32_t *idxslot(const struct sketchidx *ix,u_int64_t h)
+{
+	size_t k;
+
+	for(k=SLOT(h,ix->bits);ix->table[k]!=0;k=(k+1)&(ix->nslot-1))
+		if(ix->s[ix->table[k]-1].h==h)
+			break;
+
+	return &ix->table[k];
+}
+
+/* Add the sketch of old file number file to ix */
+static void idxadd(struct sketchidx *ix,const struct sketch *sk,size_t file)
+{
+	u_int32_t *t,*old;
+	size_t i,n;
+
+	for(i=0;i<sk->n;i++) {
+		/* Keep the table at most half full */
+		if(2*(ix->used+1)>ix->nslot) {
+			old=ix->table;
+			n=ix->nslot;
+			ix->bits=(n==0)?12:ix->bits+1;
+			ix->nslot=(size_t)1<<ix->bits;
+			if((ix->table=calloc(ix->nslot,sizeof(*ix->table)))==
+			    NULL)
+				err(1,NULL);
+			while(n-->0)
+				if(old[n]!=0)
+					*idxslot(ix,ix->s[old[n]-1].h)=old[n];
+			free(old);
+		};
+		if(ix->n==ix->alloc) {
+			ix->alloc=ix->alloc*2+65536;
+			if(ix->alloc>0xFFFFFFFFU)
+				errx(1,"too much old data to sketch");
+			if((ix->s=realloc(ix->s,ix->alloc*sizeof(*ix->s)))==NULL)
+				err(1,NULL);
+		};
+		t=idxslot(ix,sk->h[i]);
+		if(*t==0)
+			ix->used++;
+		ix->s[ix->n].h=sk->h[i];
+		ix->s[ix->n].file=file;
+		ix->s[ix->n].next=*t;
+		*t=++ix->n;
+	};
+}
+
+/* Choose in bases[] the old file of oldt that each file of newt is to
+	be diffed against, or -2 for none; see above */
+static void sketchmatch(const struct tree *oldt,const struct tree *newt,
+	off_t *bases)
+{
+	struct sketchidx ix;
+	struct sketch sk;
+	size_t *count,*touched,ntouched,i,j,k;
+	u_char *buf;
+	off_t alloc,best,samei;
+	char **same;
+
+	gearinit();
+	memset(&ix,0,sizeof(ix));
+	memset(&sk,0,sizeof(sk));
+	buf=NULL;
+	alloc=0;
+	if(oldt->n>0xFFFFFFFFU)
+		errx(1,"too many old files to sketch");
+	if(((count=calloc(oldt->n+1,sizeof(*count)))==NULL) ||
+	    ((touched=calloc(oldt->n+1,sizeof(*touched)))==NULL))
+		err(1,NULL);
+	for(i=0;i<oldt->n;i++) {
+		sketchfile(&sk,oldt,i,&buf,&alloc);
+		idxadd(&ix,&sk,i);
+	};
+
+	for(i=0;i<newt->n;i++) {
+		sketchfile(&sk,newt,i,&buf,&alloc);
+
+		/* Count the new file's samples that each old file has */
+		ntouched=0;
+		for(j=0;(j<sk.n)&&(ix.nslot>0);j++)
+			for(k=*idxslot(&ix,sk.h[j]);k!=0;k=ix.s[k-1].next)
+				if(count[ix.s[k-1].file]++==0)
+					touched[ntouched++]=ix.s[k-1].file;
+
+		/* Take the old file with the most, preferring one at the
+			same path, then the smallest, which sorts fastest */
+		same=(oldt->n==0)?NULL:bsearch(&newt->names[i],oldt->names,
+		    oldt->n,sizeof(*oldt->names),namecmp);
+		samei=(same!=NULL)?same-oldt->names:-1;
+		best=samei;
+		for(j=0;j<ntouched;j++) {
+			k=touched[j];
+			if((best<0) || (count[k]>count[best]) ||
+			    ((count[k]==count[best]) && (best!=samei) &&
+			    (oldt->sizes[k]<oldt->sizes[best])))
+				best=k;
+		};
+		if((best>=0) && (sk.n>0) &&
+		    (count[best]*100<MATCH_PERCENT*sk.n))
+			best=samei;
+		if(best<0)
+			best=-2;
+		bases[i]=best;
+		for(j=0;j<ntouched;j++)
+			count[touched[j]]=0;
+	};
+
+	free(count);
+	free(touched);
+	free(buf);
+	free(sk.h);
+	free(ix.s);
+	free(ix.table);
+}
+
+/* With -m, the new files of a bundle in order of the old file they are
+	diffed against.  Workers take all the new files with the next old
+	file, so that each old file is sorted once */
+struct pairing {
+	const struct tree *oldt,*newt;
+	const struct bsdiff_opts *opts;
+	const off_t *bases;
+	size_t *order;
+	struct bsdiff_output *outs;
+	size_t next;
+	pthread_mutex_t lock;
+};
 
-			dblen+=lenf;
-			eblen+=(scan-lenb)-(lastscan+lenf);
+static const off_t *pairbases;
 
-			offtout(lenf,buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+static int basecmp(const void *a,const void *b)
+{
+	off_t x=pairbases[*(const size_t *)a],y=pairbases[*(const size_t *)b];
+
+	if(x!=y) return (x<y)?-1:1;
+	return (*(const size_t *)a<*(const size_t *)b)?-1:1;
+}
 
-			offtout((scan-lenb)-(lastscan+lenf),buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+static void *pairworker(void *arg)
+{
+	struct pairing *pr=arg;
+	struct bsdiff_index *idx;
+	struct infile oldf;
+	size_t i,j;
+	off_t base;
+	char *new;
+	int e;
 
-			offtout((pos-lenb)-(lastpos+lenf),buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+	for(;;) {
+		pthread_mutex_lock(&pr->lock);
+		i=j=pr->next;
+		base=-2;
+		if(i<pr->newt->n) {
+			base=pr->bases[pr->order[i]];
+			while((j<pr->newt->n) && (pr->bases[pr->order[j]]==base))
+				j++;
+		};
+		pr->next=j;
+		pthread_mutex_unlock(&pr->lock);
+		if(i>=pr->newt->n) break;
 
-			lastscan=scan-lenb;
-			lastpos=pos-lenb;
-			lastoffset=pos-scan;
+		oldf.name=NULL;
+		oldf.buf=(u_char *)"";
+		oldf.size=0;
+		oldf.mapped=1;
+		if(base>=0) {
+			oldf.name=pathjoin(pr->oldt->root,
+			    pr->oldt->names[base]);
+			inload(&oldf);
+			if(oldf.size!=pr->oldt->sizes[base])
+				errx(1,"%s: changed while being read",oldf.name);
+		};
+		if((e=bsdiff_index_build(&idx,oldf.buf,oldf.size))!=0)
+			errx(1,"%s",bsdiff_strerror(e));
+		for(;i<j;i++) {
+			new=pathjoin(pr->newt->root,pr->newt->names[pr->order[i]]);
+			diffone(idx,pr->opts,new,pr->newt->names[pr->order[i]],
+			    &pr->outs[pr->order[i]]);
+			free(new);
 		};
+		bsdiff_index_free(idx);
+		if(base>=0) {
+			inclose(&oldf);
+			free((char *)oldf.name);
+		};
+	};
+
+	return NULL;
+}
+
+/* With -B, diff every file under newroot against all the files under
+	oldroot joined end to end, sorting them once, or with match against
+	the one old file sketchmatch() picks for it, and write one bundle
+	holding the patches; see bsformat.h */
+static void bundle(const char *oldroot,const char *newroot,
+	const char *fname,const struct bsdiff_opts *opts,int threads,
+	int match)
+{
+	struct tree oldt,newt;
+	struct bsdiff_index *idx;
+	struct bsdiff_opts bopts;
+	struct bsdiff_output *outs;
+	struct patchfile pf;
+	struct batch batch;
+	struct pairing pr;
+	struct stat sb;
+	u_char *old,*manifest,*head;
+	off_t oldsize,pos,*bases;
+	size_t i,mlen;
+	unsigned int hlen;
+	char *full;
+	int fd,e;
+
+	treeload(&oldt,oldroot);
+	treeload(&newt,newroot);
+	for(i=0,oldsize=0;i<oldt.n;i++) {
+		full=pathjoin(oldroot,oldt.names[i]);
+		if(stat(full,&sb)==-1)
+			err(1,"%s",full);
+		oldt.sizes[i]=sb.st_size;
+		oldsize+=sb.st_size;
+		free(full);
+	};
+	if(((bases=calloc(newt.n+1,sizeof(*bases)))==NULL) ||
+	    ((outs=calloc(newt.n+1,sizeof(*outs)))==NULL))
+		err(1,NULL);
+
+	/* The patches are made in memory, as the bundle needs every
+		patch's length before the first patch */
+	if(match) {
+		sketchmatch(&oldt,&newt,bases);
+		memset(&pr,0,sizeof(pr));
+		if((pr.order=calloc(newt.n+1,sizeof(*pr.order)))==NULL)
+			err(1,NULL);
+		for(i=0;i<newt.n;i++)
+			pr.order[i]=i;
+		pairbases=bases;
+		if(newt.n>0)
+			qsort(pr.order,newt.n,sizeof(*pr.order),basecmp);
+		pr.oldt=&oldt;
+		pr.newt=&newt;
+		pr.opts=opts;
+		pr.bases=bases;
+		pr.outs=outs;
+		if((errno=pthread_mutex_init(&pr.lock,NULL))!=0)
+			err(1,"pthread_mutex_init");
+		workers(pairworker,&pr,MIN((size_t)threads,newt.n));
+		pthread_mutex_destroy(&pr.lock);
+		free(pr.order);
+	} else {
+		/* Join the old files into one buffer and sort it */
+		if((old=malloc(oldsize+1))==NULL) err(1,NULL);
+		for(i=0,pos=0;i<oldt.n;pos+=oldt.sizes[i++]) {
+			full=pathjoin(oldroot,oldt.names[i]);
+			if((fd=open(full,O_RDONLY,0))<0)
+				err(1,"%s",full);
+			readall(fd,full,old+pos,oldt.sizes[i]);
+			if(close(fd)==-1) err(1,"%s",full);
+			free(full);
+		};
+		if((e=bsdiff_index_build(&idx,old,oldsize))!=0)
+			errx(1,"%s",bsdiff_strerror(e));
+
+		memset(&batch,0,sizeof(batch));
+		if((batch.names=calloc(2*newt.n+1,sizeof(*batch.names)))==NULL)
+			err(1,NULL);
+		for(i=0;i<newt.n;i++) {
+			batch.names[2*i]=pathjoin(newroot,newt.names[i]);
+			batch.names[2*i+1]=newt.names[i];
+			bases[i]=-1;
+		};
+		bopts=*opts;
+		if(bopts.minjump==0)
+			bopts.minjump=BUNDLE_MINJUMP;
+		batch.idx=idx;
+		batch.opts=&bopts;
+		batch.outs=outs;
+		batch.n=newt.n;
+		batchrun(&batch,threads);
+		for(i=0;i<newt.n;i++)
+			free(batch.names[2*i]);
+		free(batch.names);
+		bsdiff_index_free(idx);
+		free(old);
+	};
+	for(i=0;i<newt.n;i++)
+		newt.sizes[i]=outs[i].len;
+
+	/* The header and manifest, then the patches */
+	for(i=0,mlen=0;i<oldt.n;i++)
+		mlen+=16+strlen(oldt.names[i]);
+	for(i=0;i<newt.n;i++)
+		mlen+=24+strlen(newt.names[i]);
+	if((manifest=malloc(mlen+1))==NULL) err(1,NULL);
+	for(i=0,pos=0;i<oldt.n;i++)
+		pos+=manifestentry(manifest+pos,oldt.sizes[i],NULL,
+		    oldt.names[i]);
+	for(i=0;i<newt.n;i++)
+		pos+=manifestentry(manifest+pos,newt.sizes[i],&bases[i],
+		    newt.names[i]);
+
+	/* The names compress well, so the manifest is bzip2ed */
+	if((unsigned int)mlen!=mlen)
+		errx(1,"%s: too many names",fname);
+	hlen=mlen+mlen/100+600;
+	if((head=malloc(BSBUNDLE_HEADERLEN+hlen))==NULL) err(1,NULL);
+	if(BZ2_bzBuffToBuffCompress((char *)head+BSBUNDLE_HEADERLEN,&hlen,
+	    (char *)manifest,mlen,9,0,0)!=BZ_OK)
+		errx(1,"BZ2_bzBuffToBuffCompress failed");
+	memcpy(head,BSBUNDLE_MAGIC,8);
+	offtout(oldt.n,head+8);
+	offtout(newt.n,head+16);
+	offtout(hlen,head+24);
+	offtout(mlen,head+32);
+	pos=BSBUNDLE_HEADERLEN+hlen;
+
+	/* The bundle is written in order, so it may go down a pipe */
+	pf.name=fname;
+	if(strcmp(pf.name,"-")==0) {
+		pf.name="stdout";
+		pf.fd=STDOUT_FILENO;
+	} else if((pf.fd=open(pf.name,O_CREAT|O_TRUNC|O_WRONLY,0666))<0)
+		err(1,"%s",pf.name);
+	if(fstat(pf.fd,&sb)==-1)
+		err(1,"%s",pf.name);
+	pf.pipe=!S_ISREG(sb.st_mode);
+	pf.pos=0;
+	patchwrite(&pf,0,head,pos);
+	for(i=0;i<newt.n;i++) {
+		patchwrite(&pf,pos,outs[i].buf,outs[i].len);
+		pos+=outs[i].len;
+		free(outs[i].buf);
+	};
+	if(close(pf.fd)==-1)
+		err(1,"%s",pf.name);
+
+	free(head);
+	free(manifest);
+	free(bases);
+	free(outs);
+	treefree(&oldt);
+	treefree(&newt);
+}
+
+/* Read the n files named by names into one buffer, end to end, with
+	their sizes in sizes[] and the total in *size */
+static u_char *oldjoin(char *const *names,int n,off_t *sizes,off_t *size)
+{
+	struct stat sb;
+	u_char *old;
+	off_t pos;
+	int i,fd;
+
+	for(i=0,*size=0;i<n;i++) {
+		if(stat(names[i],&sb)==-1)
+			err(1,"%s",names[i]);
+		sizes[i]=sb.st_size;
+		*size+=sb.st_size;
 	};
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
-
-	/* Compute size of compressed ctrl data */
-	if ((len = ftello(pf)) == -1)
-		err(1, "ftello");
-	offtout(len-32, header + 8);
-
-	/* Write compressed diff data */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	BZ2_bzWrite(&bz2err, pfbz2, db, dblen);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
-
-	/* Compute size of compressed diff data */
-	if ((newsize = ftello(pf)) == -1)
-		err(1, "ftello");
-	offtout(newsize - len, header + 16);
-
-	/* Write compressed extra data */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	BZ2_bzWrite(&bz2err, pfbz2, eb, eblen);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
-
-	/* Seek to the beginning, write the header, and close the file */
-	if (fseeko(pf, 0, SEEK_SET))
-		err(1, "fseeko");
-	if (fwrite(header, 32, 1, pf) != 1)
-		err(1, "fwrite(%s)", argv[3]);
-	if (fclose(pf))
-		err(1, "fclose");
-
-	/* Free the memory we used */
-	free(db);
-	free(eb);
-	free(I);
+	if((old=malloc(*size+1))==NULL) err(1,NULL);
+	for(i=0,pos=0;i<n;pos+=sizes[i++]) {
+		if((fd=open(names[i],O_RDONLY,0))<0)
+			err(1,"%s",names[i]);
+		readall(fd,names[i],old+pos,sizes[i]);
+		if(close(fd)==-1) err(1,"%s",names[i]);
+	};
+
+	return old;
+}
+
+/* Most old versions -P will plan for, as it makes a patch from every
+	set of them */
+#define PLAN_MAXBASES	12
+
+/* With -P, the size of the patch from every set of old versions, as a
+	bitmask of them, all made against the one index.  Workers take the
+	next set as they finish the last */
+struct plan {
+	const struct bsdiff_index *idx;
+	const struct bsdiff_opts *opts;
+	const u_char *new;
+	off_t newsize;
+	const off_t *sizes;
+	int n;
+	off_t *bytes;		/* Indexed by set */
+	unsigned int next;
+	pthread_mutex_t lock;
+};
+
+/* Count the bytes of a patch instead of writing it */
+static int countwrite(void *opaque,off_t pos,const u_char *buf,size_t len)
+{
+	off_t *size=opaque;
+
+	(void)buf;
+	if(pos+(off_t)len>*size)
+		*size=pos+len;
+
+	return 0;
+}
+
+static void *planworker(void *arg)
+{
+	struct plan *pl=arg;
+	struct bsdiff_output out;
+	unsigned int set;
+	int use[PLAN_MAXBASES],i,e;
+
+	for(;;) {
+		pthread_mutex_lock(&pl->lock);
+		set=pl->next++;
+		pthread_mutex_unlock(&pl->lock);
+		if(set>=1U<<pl->n) break;
+		for(i=0;i<pl->n;i++)
+			use[i]=(set>>i)&1;
+		memset(&out,0,sizeof(out));
+		out.write=countwrite;
+		out.opaque=&pl->bytes[set];
+		if((e=bsdiff_diff_bases(pl->idx,pl->sizes,use,pl->n,pl->new,
+		    pl->newsize,pl->opts,&out))!=0)
+			errx(1,"%s",bsdiff_strerror(e));
+	};
+
+	return NULL;
+}
+
+static const off_t *planbytes;
+
+/* Smallest patch first, then the fewest old versions */
+static int plancmp(const void *a,const void *b)
+{
+	unsigned int x=*(const unsigned int *)a,y=*(const unsigned int *)b;
+	unsigned int i;
+	int nx,ny;
+
+	if(planbytes[x]!=planbytes[y])
+		return (planbytes[x]<planbytes[y])?-1:1;
+	for(i=x,nx=0;i!=0;i&=i-1) nx++;
+	for(i=y,ny=0;i!=0;i&=i-1) ny++;
+	if(nx!=ny) return nx-ny;
+	return (x<y)?-1:(x>y);
+}
+
+/* With -P, report the size of the patch from every set of the n old
+	versions named by names to newname, smallest first */
+static void plan(char **names,int n,const char *newname,
+	const struct bsdiff_opts *opts,int threads)
+{
+	struct infile newf;
+	struct bsdiff_index *idx;
+	struct plan pl;
+	u_char *old;
+	off_t sizes[PLAN_MAXBASES],oldsize;
+	unsigned int *order,nset,set;
+	int i,e;
+
+	old=oldjoin(names,n,sizes,&oldsize);
+	newf.name=newname;
+	inload(&newf);
+	if((e=bsdiff_index_build(&idx,old,oldsize))!=0)
+		errx(1,"%s",bsdiff_strerror(e));
+
+	nset=1U<<n;
+	memset(&pl,0,sizeof(pl));
+	if(((pl.bytes=calloc(nset,sizeof(*pl.bytes)))==NULL) ||
+	    ((order=calloc(nset,sizeof(*order)))==NULL))
+		err(1,NULL);
+	pl.idx=idx;
+	pl.opts=opts;
+	pl.new=newf.buf;
+	pl.newsize=newf.size;
+	pl.sizes=sizes;
+	pl.n=n;
+	pl.next=1;
+	if((errno=pthread_mutex_init(&pl.lock,NULL))!=0)
+		err(1,"pthread_mutex_init");
+	workers(planworker,&pl,MIN((unsigned int)threads,nset-1));
+	pthread_mutex_destroy(&pl.lock);
+
+	for(set=1;set<nset;set++)
+		order[set-1]=set;
+	planbytes=pl.bytes;
+	qsort(order,nset-1,sizeof(*order),plancmp);
+	for(set=0;set<nset-1;set++) {
+		printf("%lld",(long long)pl.bytes[order[set]]);
+		for(i=0;i<n;i++)
+			if(order[set]&(1U<<i))
+				printf(" %s",names[i]);
+		printf("\n");
+	};
+	if(fflush(stdout)==EOF)
+		err(1,"stdout");
+
+	free(order);
+	free(pl.bytes);
+	bsdiff_index_free(idx);
+	inclose(&newf);
 	free(old);
-	free(new);
+}
+
+static void usage(void)
+{
+	errx(1,"usage: bsdiff [-cdinoprz] [-s segsize] oldfile newfile "
+	    "patchfile\n"
+	    "       bsdiff [-cdinoprz] [-s segsize] [-j threads] "
+	    "-b manifest oldfile\n"
+	    "       bsdiff [-cdmnoprz] [-s segsize] [-j threads] "
+	    "-B olddir newdir bundle\n"
+	    "       bsdiff [-cdnoprz] [-s segsize] -M count oldfile ... "
+	    "newfile patchfile\n"
+	    "       bsdiff [-cdnoprz] [-s segsize] [-j threads] "
+	    "-P oldfile ... newfile\n");
+}
+
+int main(int argc,char *argv[])
+{
+	int ch,e;
+	struct infile oldf,newf;
+	pthread_t loader;
+	struct bsdiff_index *idx;
+	struct bsdiff_opts opts;
+	struct bsdiff_output out;
+	struct patchfile pf;
+	struct batch batch;
+	struct stat sb;
+	const char *manifest;
+	off_t *oldsizes;
+	char *end;
+	int threads,dirs,match,nold,planning;
+
+	memset(&opts,0,sizeof(opts));
+	manifest=NULL;
+	threads=dirs=match=nold=planning=0;
+	while((ch=getopt(argc,argv,"Bb:cdij:M:mnoPprs:z"))!=-1) {
+		switch(ch) {
+		case 'B':
+			dirs=1;
+			break;
+		case 'M':
+			nold=strtol(optarg,&end,10);
+			if((*optarg=='\0') || (*end!='\0') || (nold<1))
+				errx(1,"invalid old file count: %s",optarg);
+			break;
+		case 'P':
+			planning=1;
+			break;
+		case 'b':
+			manifest=optarg;
+			break;
+		case 'c':
+			opts.flags|=BSDF_COLUMNS;
+			break;
+		case 'd':
+			opts.flags|=BSDF_DIGEST;
+			break;
+		case 'i':
+			opts.flags|=BSDF_SEGMENTS|BSDF_INPLACE;
+			break;
+		case 'j':
+			threads=strtol(optarg,&end,10);
+			if((*optarg=='\0') || (*end!='\0') || (threads<0))
+				errx(1,"invalid thread count: %s",optarg);
+			break;
+		case 'm':
+			match=1;
+			break;
+		case 'n':
+			opts.compact=1;
+			break;
+		case 'o':
+			opts.flags|=BSDF_OPS;
+			break;
+		case 'p':
+			opts.flags|=BSDF_SEGMENTS|BSDF_STREAM;
+			break;
+		case 'r':
+			opts.selfref=1;
+			break;
+		case 's':
+			opts.segsize=parsesize(optarg);
+			opts.flags|=BSDF_SEGMENTS;
+			break;
+		case 'z':
+			opts.flags|=BSDF_SPARSE;
+			break;
+		default:
+			usage();
+		};
+	};
+	argc-=optind;
+	argv+=optind;
+
+	/* With -P, every operand but the last is an old version */
+	if(planning) {
+		if((argc<2) || (manifest!=NULL) || dirs || match || nold)
+			usage();
+		if(argc-1>PLAN_MAXBASES)
+			errx(1,"-P plans for at most %d old files",
+			    PLAN_MAXBASES);
+		if(opts.flags&BSDF_INPLACE)
+			errx(1,"-P cannot be used with -i");
+		plan(argv,argc-1,argv[argc-1],&opts,threads);
+		return 0;
+	};
+
+	if(nold==0)
+		nold=1;
+	if((argc!=((manifest!=NULL)?1:nold+2)) ||
+	    ((manifest==NULL) && !dirs && threads) ||
+	    ((manifest!=NULL) && dirs) || (match && !dirs) ||
+	    ((nold>1) && ((manifest!=NULL) || dirs)))
+		usage();
+
+	/* The old of a bundle is not a file that could be patched in
+		place */
+	if(dirs) {
+		if(opts.flags&BSDF_INPLACE)
+			errx(1,"-B cannot be used with -i");
+		bundle(argv[0],argv[1],argv[2],&opts,threads,match);
+		return 0;
+	};
+
+	/* With -M, old is the old versions joined end to end */
+	if(nold>1) {
+		if(opts.flags&BSDF_INPLACE)
+			errx(1,"-M cannot be used with -i");
+		if((oldsizes=calloc(nold,sizeof(*oldsizes)))==NULL)
+			err(1,NULL);
+		oldf.name=argv[0];
+		oldf.buf=oldjoin(argv,nold,oldsizes,&oldf.size);
+		oldf.mapped=0;
+		free(oldsizes);
+		argv+=nold-1;
+	} else {
+		oldf.name=argv[0];
+		inload(&oldf);
+	};
+
+	/* With -b, sort old once and diff every new file against it */
+	if(manifest!=NULL) {
+		batchload(&batch,manifest);
+		batch.outs=NULL;
+		if((e=bsdiff_index_build(&idx,oldf.buf,oldf.size))!=0)
+			errx(1,"%s",bsdiff_strerror(e));
+		batch.idx=idx;
+		batch.opts=&opts;
+		batchrun(&batch,threads);
+		free(batch.names);
+		free(batch.text);
+		bsdiff_index_free(idx);
+		inclose(&oldf);
+		return 0;
+	};
+
+	/* Load new in the background while old is sorted */
+	newf.name=argv[1];
+	if((errno=pthread_create(&loader,NULL,inloadthread,&newf))!=0)
+		err(1,"pthread_create");
+
+	if((e=bsdiff_index_build(&idx,oldf.buf,oldf.size))!=0)
+		errx(1,"%s",bsdiff_strerror(e));
+
+	if((errno=pthread_join(loader,NULL))!=0)
+		err(1,"pthread_join");
+
+	/* Create the patch file, or with "-" write to stdout */
+	pf.name=argv[2];
+	if(strcmp(pf.name,"-")==0) {
+		pf.name="stdout";
+		pf.fd=STDOUT_FILENO;
+	} else if((pf.fd=open(pf.name,O_CREAT|O_TRUNC|O_WRONLY,0666))<0)
+		err(1,"%s",pf.name);
+	if(fstat(pf.fd,&sb)==-1)
+		err(1,"%s",pf.name);
+	pf.pipe=!S_ISREG(sb.st_mode);
+	pf.pos=0;
+	memset(&out,0,sizeof(out));
+	out.write=patchwrite;
+	out.opaque=&pf;
+
+	/* Other patches are made in memory before going down a pipe */
+	if(pf.pipe && !(opts.flags&BSDF_STREAM))
+		out.write=NULL;
+
+	if((e=bsdiff_diff(idx,newf.buf,newf.size,&opts,&out))!=0)
+		errx(1,"%s",bsdiff_strerror(e));
+	if(out.write==NULL) {
+		patchwrite(&pf,0,out.buf,out.len);
+		free(out.buf);
+	};
+	if(close(pf.fd)==-1)
+		err(1,"%s",pf.name);
+
+	bsdiff_index_free(idx);
+	inclose(&oldf);
+	inclose(&newf);
 
 	return 0;
 }
@@ -0,0 +1,130 @@
+/*-
+ * Copyright 2026 The Android Open Source Project
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BSDIFF_H
+#define BSDIFF_H
+
+#include <sys/types.h>
+#include <stddef.h>
+
+/*
+ * libbsdiff makes bsdiff(1) patches inside the calling process.
+ *
+ * The expensive part of a diff, sorting the suffixes of old, is done
+ * once by bsdiff_index_build(), or skipped by loading an index saved
+ * earlier with bsdiff_index_save().  Any number of new files may then
+ * be diffed against the index with bsdiff_diff(), from any number of
+ * threads at once; the index is never modified after it is built.
+ * bsdiff_write() writes a patch whose control data has been worked out
+ * some other way, as bscompose(1) does from two existing patches.
+ * Functions return BSDIFF_OK or one of the negative error codes below,
+ * and never exit or print anything.
+ */
+
+#define BSDIFF_OK		0
+#define BSDIFF_ENOMEM		(-1)	/* Out of memory */
+#define BSDIFF_EIO		(-2)	/* The output's write() failed */
+#define BSDIFF_EINVAL		(-3)	/* Bad options */
+#define BSDIFF_ECORRUPT		(-4)	/* A saved index is malformed */
+
+/* Where a patch or saved index goes: through write(), which must store
+	the len bytes at buf at offset pos and return 0, or return -1, or if
+	write is NULL into a malloc'd buffer left in buf and len for the
+	caller to free().  Parts already written may be written again,
+	except with BSDF_STREAM, which writes each byte once and in order,
+	so that write() can feed a pipe */
+struct bsdiff_output {
+	int (*write)(void *opaque,off_t pos,const unsigned char *buf,
+	    size_t len);
+	void *opaque;
+	unsigned char *buf;
+	off_t len;
+};
+
+/* What kind of patch to make; see bsformat.h.  A zeroed structure, or
+	NULL, gives a BSDIFF40 patch as bsdiff with no options does */
+struct bsdiff_opts {
+	int compact;		/* BSDIFF41 even without flags (bsdiff -n) */
+	off_t flags;		/* BSDF_* flags; any of them imply compact */
+	int selfref;		/* Look for repeats within new (-r); implies
+				   BSDF_OPS */
+	off_t segsize;		/* With BSDF_SEGMENTS; 0 for the bsdiff -i
+				   default, which needs BSDF_INPLACE or
+				   BSDF_STREAM */
+	off_t minjump;		/* How many bytes more a match elsewhere in
+				   old must cover than carrying on where the
+				   last one left off, for the diff to move to
+				   it; 0 for the usual 8 */
+};
+
+struct bsdiff_index;
+
+/* Sort the suffixes of old[0..oldsize), which must stay where it is
+	until the index is freed */
+int bsdiff_index_build(struct bsdiff_index **idxp,const unsigned char *old,
+    off_t oldsize);
+
+/* Save an index, or load one saved for the same old.  Loading checks
+	that the index is well formed but not that it was made from old; a
+	mismatched one gives poor patches, not wrong ones */
+int bsdiff_index_save(const struct bsdiff_index *idx,
+    struct bsdiff_output *out);
+int bsdiff_index_load(struct bsdiff_index **idxp,const unsigned char *old,
+    off_t oldsize,const unsigned char *buf,off_t len);
+
+void bsdiff_index_free(struct bsdiff_index *idx);
+
+/* Write a patch from the indexed old to new[0..newsize) to out */
+int bsdiff_diff(const struct bsdiff_index *idx,const unsigned char *new,
+    off_t newsize,const struct bsdiff_opts *opts,struct bsdiff_output *out);
+
+/* With an index of n old versions joined end to end, sizes[i] bytes
+	each, write a patch to new that uses only the versions i with use[i]
+	set, and applies to them joined in the same order, without sorting
+	them again.  BSDF_INPLACE is not allowed unless all are used */
+int bsdiff_diff_bases(const struct bsdiff_index *idx,const off_t *sizes,
+    const int *use,int n,const unsigned char *new,off_t newsize,
+    const struct bsdiff_opts *opts,struct bsdiff_output *out);
+
+/* A control triple: lenf bytes of new made by adding diff bytes to old
+	from oldpos on, followed by extra bytes carried in the patch */
+struct bsdiff_triple {
+	off_t oldpos,lenf,extra;
+};
+
+/* Write a patch made of the triples t[0..nt), which between them cover
+	all newsize bytes of new in order, without old or new at hand: res
+	holds the diff bytes where the triples add to old, and new's bytes
+	where they carry extra ones.  opts->selfref and BSDF_INPLACE, which
+	need old and new, are not allowed; with BSDF_DIGEST, digest holds
+	the digests of old and of new, 32 bytes each */
+int bsdiff_write(const struct bsdiff_triple *t,off_t nt,
+    const unsigned char *res,off_t newsize,const unsigned char *digest,
+    const struct bsdiff_opts *opts,struct bsdiff_output *out);
+
+const char *bsdiff_strerror(int error);
+
+#endif /* !BSDIFF_H */
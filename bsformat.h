@@ -0,0 +1,193 @@
+/*-
+ * Copyright 2026 The Android Open Source Project
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BSFORMAT_H
+#define BSFORMAT_H
+
+/*
+ * Patch formats understood by bsdiff(1) and bspatch(1).
+ *
+ * BSDIFF40 is the original format:
+ *	0	8	"BSDIFF40"
+ *	8	8	X
+ *	16	8	Y
+ *	24	8	sizeof(newfile)
+ *	32	X	bzip2(control block)
+ *	32+X	Y	bzip2(diff block)
+ *	32+X+Y	???	bzip2(extra block)
+ * where the control block is a sequence of triples (x,y,z), each field
+ * an 8-byte sign-magnitude integer, meaning "add x bytes from oldfile to
+ * x bytes from the diff block; copy y bytes from the extra block; seek
+ * forwards in oldfile by z bytes".
+ *
+ * BSDIFF41 keeps the same three blocks behind a slightly longer header:
+ *	0	8	"BSDIFF41"
+ *	8	8	flags (BSDF_*)
+ *	16	8	X
+ *	24	8	Y
+ *	32	8	sizeof(newfile)
+ *	40	X	bzip2(control block)
+ *	40+X	Y	bzip2(diff block)
+ *	40+X+Y	???	bzip2(extra block)
+ * but writes each control triple as three varints: x and y unsigned,
+ * z zigzag-encoded.  z is already relative to where the previous triple
+ * left the oldfile pointer, so it is usually small.
+ *
+ * Header fields are always 8-byte sign-magnitude integers.
+ *
+ * BSDIFF41 flags:
+ *
+ * BSDF_COLUMNS: the control block is split by field into three
+ * separately compressed columns (all x values, then all y values, then
+ * all z values), each of which compresses better on its own:
+ *	0	8	X0
+ *	8	8	X1
+ *	16	X0	bzip2(x column)
+ *	16+X0	X1	bzip2(y column)
+ *	16+X0+X1 ???	bzip2(z column)
+ * The block still ends where the diff block starts.
+ *
+ * BSDF_SPARSE: the diff block, which is mostly zero bytes, is stored as
+ * a sequence of runs
+ *	varint	number of zero bytes
+ *	varint	number of literal bytes (n)
+ *	n	literal bytes
+ * so that the compressor never sees the zeros and the patcher can copy
+ * zero runs straight from oldfile.  Runs do not have to line up with
+ * control triples.
+ *
+ * BSDF_OPS: the control block holds a sequence of operations instead of
+ * triples.  Each starts with a varint head, (length << 3) | opcode:
+ *	BSOP_ADD	add length bytes of the diff block to oldfile
+ *	BSOP_COPY	copy length bytes of oldfile unchanged
+ *	BSOP_INSERT	copy length bytes of the extra block
+ *	BSOP_FILL	write length copies of one byte, given by a
+ *			varint argument
+ *	BSOP_SEEK	move the oldfile pointer by a zigzag varint
+ *			argument; length must be zero
+ *	BSOP_COPYNEW	copy length bytes of newfile from a varint
+ *			argument's distance back; the source may overlap
+ *			the bytes being written, as in LZ77
+ * ADD and COPY advance the oldfile pointer by length.  Only ADD
+ * consumes diff data and only INSERT consumes extra data, so exact
+ * copies, constant runs and repeats cost nothing in either block.
+ * Heads, FILL and COPYNEW arguments, and SEEK arguments take the place
+ * of x, y and z when BSDF_COLUMNS is also set.
+ *
+ * BSDF_SEGMENTS: newfile is cut into segments of Y bytes (the last one
+ * may be shorter), each with control, diff and extra blocks of its own,
+ * and X is the length of an index following the header, holding for
+ * each segment
+ *	0	8	oldfile pointer at the start of the segment
+ *	8	8	length of its bzip2(control block)
+ *	16	8	length of its bzip2(diff block)
+ *	24	8	length of its bzip2(extra block)
+ * The segments' blocks follow the index in order, laid out as the
+ * blocks of an unsegmented patch and subject to the same flags.  No
+ * operation reaches back before the start of its own segment with
+ * COPYNEW, so any segment can be applied without the others.
+ *
+ * BSDF_INPLACE: with BSDF_SEGMENTS, the index is followed by the
+ * numbers of the segments, each an 8-byte field, in an order in which
+ * they can be applied with newfile overwriting oldfile in the same
+ * storage, one segment at a time; X covers both.  No segment reads
+ * oldfile data that a segment earlier in the order has overwritten.
+ *
+ * BSDF_DIGEST: the header is followed by the SHA-256 digests of oldfile
+ * and of newfile, 32 bytes each, and everything after the header moves
+ * along by 64 bytes.  Patchers check both, so that an update does not
+ * need to read newfile again afterwards.
+ *
+ * BSDF_STREAM: with BSDF_SEGMENTS, there is no index after the header
+ * and X is zero; instead each segment's index entry comes right before
+ * its blocks.  Everything a patcher needs then arrives in the order in
+ * which it is used, so a patch can be applied as it is read from a
+ * pipe, and written by bsdiff without seeking back.
+ *
+ * A bundle, made by bsdiff -B, patches a whole directory tree at once:
+ *	0	8	"BSBUNDLE"
+ *	8	8	number of old files (M)
+ *	16	8	number of new files (N)
+ *	24	8	X
+ *	32	8	length of the manifest
+ *	40	X	bzip2(manifest)
+ *	40+X	???	the N patches, one after another
+ * The manifest lists the M old files, each as
+ *	0	8	size of the file
+ *	8	8	length of its name (K)
+ *	16	K	name
+ * followed by the N new files, each as
+ *	0	8	length of its patch
+ *	8	8	base
+ *	16	8	length of its name (K)
+ *	24	K	name
+ * Names are relative to the top of the tree, with components separated
+ * by '/'.  Each patch is an ordinary patch, in any of the formats above.
+ * Its oldfile is given by base: -1 for every old file joined end to end
+ * in manifest order, so that a new file can draw on any of them, -2 for
+ * an empty file, or otherwise the old file with that number, counting
+ * from 0 in manifest order.
+ */
+
+#define BSDIFF40_MAGIC		"BSDIFF40"
+#define BSDIFF40_HEADERLEN	32
+#define BSDIFF41_MAGIC		"BSDIFF41"
+#define BSDIFF41_HEADERLEN	40
+
+#define BSDF_COLUMNS		0x01
+#define BSDF_SPARSE		0x02
+#define BSDF_OPS		0x04
+#define BSDF_SEGMENTS		0x08
+#define BSDF_INPLACE		0x10
+#define BSDF_DIGEST		0x20
+#define BSDF_STREAM		0x40
+
+/* Readers reject any flag they do not know */
+#define BSDF_KNOWN		(BSDF_COLUMNS|BSDF_SPARSE|BSDF_OPS|BSDF_SEGMENTS|\
+				BSDF_INPLACE|BSDF_DIGEST|BSDF_STREAM)
+
+#define BSBUNDLE_MAGIC		"BSBUNDLE"
+#define BSBUNDLE_HEADERLEN	40
+
+/* Length of the BSDF_DIGEST digests */
+#define BSDIGEST_LEN		64
+
+/* Length of one BSDF_SEGMENTS index entry */
+#define BSSEG_ENTRYLEN		32
+
+/* BSDF_OPS opcodes */
+#define BSOP_ADD		0
+#define BSOP_COPY		1
+#define BSOP_INSERT		2
+#define BSOP_FILL		3
+#define BSOP_SEEK		4
+#define BSOP_COPYNEW		5
+#define BSOP_BITS		3
+
+/* Longest varint needed for a 64-bit value */
+#define VARINT_MAX		10
+
+#endif /* !BSFORMAT_H */
@@ -24,18 +24,43 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE		/* sync_file_range() */
+#endif
+
 #if 0
 __FBSDID("$FreeBSD: src/usr.bin/bsdiff/bspatch/bspatch.c,v 1.1 2005/08/06 01:59:06 cperciva Exp $");
 #endif
 
-#include <bzlib.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <err.h>
+#include <getopt.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>    // android
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+#ifdef __linux__
+#include <linux/fs.h>		/* BLKGETSIZE64 */
+#endif
+
+#include <bzlib.h>
+
+#include "bsformat.h"
+#include "bspatch.h"
+
+#define MIN(x,y) (((x)<(y)) ? (x) : (y))
+#define MAX(x,y) (((x)>(y)) ? (x) : (y))
+
+/* Largest single read or write */
+#define IO_CHUNK	(256*1024*1024)
+
+/* Bytes of new between checkpoints */
+#define CKPT_INTERVAL	(64*1024*1024)
 
 static off_t offtin(u_char *buf)
 {
@@ -55,151 +80,911 @@ static off_t offtin(u_char *buf)
 	return y;
 }
 
-int main(int argc,char * argv[])
+/* Map fd, open as fname, if possible and read it whole otherwise,
+	starting with the headlen bytes at head that have already been
+	read from it */
+static void fileload(struct bspatch_input *in,int fd,const char *fname,
+	const u_char *head,off_t headlen)
+{
+	struct stat sb;
+	u_char *buf;
+	off_t size;
+	ssize_t n;
+
+	if(fstat(fd,&sb)==-1)
+		err(1,"%s",fname);
+
+	memset(in,0,sizeof(*in));
+	if(S_ISREG(sb.st_mode) && (sb.st_size>0) && (headlen==0) &&
+		((size_t)sb.st_size==sb.st_size) &&
+		((buf=mmap(NULL,sb.st_size,PROT_READ,MAP_PRIVATE,fd,0))!=
+		MAP_FAILED)) {
+		in->size=sb.st_size;
+		in->mapped=1;
+	} else {
+		/* Pipes and the like: read until EOF.  Allocate at least
+			one byte so that buf is never NULL */
+		size=headlen+65536;
+		if((buf=malloc(size))==NULL)
+			err(1,NULL);
+		if(headlen>0)
+			memcpy(buf,head,headlen);
+		in->size=headlen;
+		do {
+			if(in->size==size) {
+				size=size*2+65536;
+				if((buf=realloc(buf,size))==NULL)
+					err(1,NULL);
+			};
+			if((n=read(fd,buf+in->size,
+			    MIN(size-in->size,IO_CHUNK)))<0) {
+				if(errno!=EINTR) err(1,"%s",fname);
+				n=1;
+				continue;
+			};
+			in->size+=n;
+		} while(n>0);
+	};
+	in->buf=buf;
+	if(close(fd)==-1) err(1,"%s",fname);
+}
+
+static void fileopen(struct bspatch_input *in,const char *fname)
+{
+	int fd;
+
+	if((fd=open(fname,O_RDONLY,0))<0)
+		err(1,"%s",fname);
+	fileload(in,fd,fname,NULL,0);
+}
+
+/* A patch made with bsdiff -p, read from a pipe as it is applied */
+struct patchpipe {
+	const char *name;
+	int fd;
+	u_char head[BSDIFF41_HEADERLEN];
+	off_t headlen;		/* Bytes read to see what kind of patch it is */
+	off_t pos;
+};
+
+static int piperead(void *opaque,off_t pos,u_char *buf,size_t len)
+{
+	struct patchpipe *pp=opaque;
+	size_t i;
+	ssize_t n;
+
+	if(pos!=pp->pos)
+		errx(1,"%s: cannot seek",pp->name);
+	pp->pos+=len;
+	for(i=0;(i<len)&&(pos+i<pp->headlen);i++)
+		buf[i]=pp->head[pos+i];
+	for(;i<len;i+=n) {
+		if((n=read(pp->fd,buf+i,MIN(len-i,IO_CHUNK)))<0) {
+			if(errno!=EINTR) err(1,"%s",pp->name);
+			n=0;
+		} else if(n==0)
+			errx(1,"%s: truncated patch",pp->name);
+	};
+
+	return 0;
+}
+
+/* Open the patch, "-" meaning stdin.  A -p patch that comes through a
+	pipe is set up to be read as it is applied, and 1 returned; any
+	other patch is mapped or read whole */
+static int patchopen(struct bspatch_input *in,struct patchpipe *pp,
+	const char *fname)
+{
+	struct stat sb;
+	ssize_t n;
+	int fd;
+
+	if(strcmp(fname,"-")==0) {
+		fname="stdin";
+		fd=STDIN_FILENO;
+	} else if((fd=open(fname,O_RDONLY,0))<0)
+		err(1,"%s",fname);
+	if(fstat(fd,&sb)==-1)
+		err(1,"%s",fname);
+	if(S_ISREG(sb.st_mode)) {
+		fileload(in,fd,fname,NULL,0);
+		return 0;
+	};
+
+	/* Look at the header; the flags word is little-endian */
+	for(pp->headlen=0;pp->headlen<BSDIFF41_HEADERLEN;pp->headlen+=n) {
+		if((n=read(fd,pp->head+pp->headlen,
+		    BSDIFF41_HEADERLEN-pp->headlen))<0) {
+			if(errno!=EINTR) err(1,"%s",fname);
+			n=0;
+		} else if(n==0)
+			break;
+	};
+	if((pp->headlen<BSDIFF41_HEADERLEN) ||
+	    (memcmp(pp->head,BSDIFF41_MAGIC,8)!=0) ||
+	    !(pp->head[8]&BSDF_STREAM)) {
+		fileload(in,fd,fname,pp->head,pp->headlen);
+		return 0;
+	};
+
+	pp->name=fname;
+	pp->fd=fd;
+	pp->pos=0;
+	memset(in,0,sizeof(*in));
+	in->sequential=1;
+	in->read=piperead;
+	in->opaque=pp;
+
+	return 1;
+}
+
+static void fileclose(struct bspatch_input *in)
+{
+	if(in->mapped)
+		munmap((void *)in->buf,in->size);
+	else
+		free((void *)in->buf);
+}
+
+/* An old file read on demand, for block devices and with -r */
+struct oldfd {
+	const char *name;
+	int fd;
+};
+
+static int oldread(void *opaque,off_t pos,u_char *buf,size_t len)
 {
-	FILE * f, * cpf, * dpf, * epf;
-	BZFILE * cpfbz2, * dpfbz2, * epfbz2;
-	int cbz2err, dbz2err, ebz2err;
+	struct oldfd *of=opaque;
+	size_t i;
+	ssize_t n;
+
+	for(i=0;i<len;i+=n) {
+		if((n=pread(of->fd,buf+i,len-i,pos+i))<0) {
+			if(errno!=EINTR) err(1,"%s",of->name);
+			n=0;
+		} else if(n==0)
+			errx(1,"%s: short read",of->name);
+	};
+
+	return 0;
+}
+
+static void oldwillneed(void *opaque,off_t pos,off_t len)
+{
+	struct oldfd *of=opaque;
+
+	posix_fadvise(of->fd,pos,len,POSIX_FADV_WILLNEED);
+}
+
+/* Set in up to read fname with oldread() if it is a block device or
+	ranged is set, and return 0 without opening it otherwise.  Block
+	devices are sized with an ioctl, since seeking to their end can be
+	slow */
+static int oldopen(struct bspatch_input *in,struct oldfd *of,
+	const char *fname,int ranged)
+{
+	struct stat sb;
+#ifdef BLKGETSIZE64
+	u_int64_t size;
+#endif
+
+	if(((of->fd=open(fname,O_RDONLY,0))<0) || (fstat(of->fd,&sb)==-1))
+		err(1,"%s",fname);
+	if(!ranged && !S_ISBLK(sb.st_mode)) {
+		if(close(of->fd)==-1) err(1,"%s",fname);
+		return 0;
+	};
+
+	memset(in,0,sizeof(*in));
+	of->name=fname;
+	in->size=sb.st_size;
+#ifdef BLKGETSIZE64
+	if(S_ISBLK(sb.st_mode)) {
+		if(ioctl(of->fd,BLKGETSIZE64,&size)==-1)
+			err(1,"%s",fname);
+		in->size=size;
+	};
+#else
+	if(S_ISBLK(sb.st_mode) &&
+	    ((in->size=lseek(of->fd,0,SEEK_END))==-1))
+		err(1,"%s",fname);
+#endif
+	in->read=oldread;
+	in->willneed=oldwillneed;
+	in->opaque=of;
+
+	return 1;
+}
+
+/* The new file, written a window at a time.  When the window is
+	smaller than the file, writeback is started as each window is
+	written and waited for one window later, so that neither memory
+	nor dirty page cache grows with the size of new */
+struct newfile {
+	const char *name;
 	int fd;
-	ssize_t oldsize,newsize;
-	ssize_t bzctrllen,bzdatalen;
-	u_char header[32],buf[8];
-	u_char *old, *new;
-	off_t oldpos,newpos;
-	off_t ctrl[3];
-	off_t lenread;
-	off_t i;
-
-	if(argc!=4) errx(1,"usage: %s oldfile newfile patchfile\n",argv[0]);
-
-	/* Open patch file */
-	if ((f = fopen(argv[3], "r")) == NULL)
-		err(1, "fopen(%s)", argv[3]);
-
-	/*
-	File format:
-		0	8	"BSDIFF40"
-		8	8	X
-		16	8	Y
-		24	8	sizeof(newfile)
-		32	X	bzip2(control block)
-		32+X	Y	bzip2(diff block)
-		32+X+Y	???	bzip2(extra block)
-	with control block a set of triples (x,y,z) meaning "add x bytes
-	from oldfile to x bytes from the diff block; copy y bytes from the
-	extra block; seek forwards in oldfile by z bytes".
-	*/
-
-	/* Read header */
-	if (fread(header, 1, 32, f) < 32) {
-		if (feof(f))
-			errx(1, "Corrupt patch\n");
-		err(1, "fread(%s)", argv[3]);
-	}
-
-	/* Check for appropriate magic */
-	if (memcmp(header, "BSDIFF40", 8) != 0)
-		errx(1, "Corrupt patch\n");
-
-	/* Read lengths from header */
-	bzctrllen=offtin(header+8);
-	bzdatalen=offtin(header+16);
-	newsize=offtin(header+24);
-	if((bzctrllen<0) || (bzdatalen<0) || (newsize<0))
-		errx(1,"Corrupt patch\n");
-
-	/* Close patch file and re-open it via libbzip2 at the right places */
-	if (fclose(f))
-		err(1, "fclose(%s)", argv[3]);
-	if ((cpf = fopen(argv[3], "r")) == NULL)
-		err(1, "fopen(%s)", argv[3]);
-	if (fseeko(cpf, 32, SEEK_SET))
-		err(1, "fseeko(%s, %lld)", argv[3],
-		    (long long)32);
-	if ((cpfbz2 = BZ2_bzReadOpen(&cbz2err, cpf, 0, 0, NULL, 0)) == NULL)
-		errx(1, "BZ2_bzReadOpen, bz2err = %d", cbz2err);
-	if ((dpf = fopen(argv[3], "r")) == NULL)
-		err(1, "fopen(%s)", argv[3]);
-	if (fseeko(dpf, 32 + bzctrllen, SEEK_SET))
-		err(1, "fseeko(%s, %lld)", argv[3],
-		    (long long)(32 + bzctrllen));
-	if ((dpfbz2 = BZ2_bzReadOpen(&dbz2err, dpf, 0, 0, NULL, 0)) == NULL)
-		errx(1, "BZ2_bzReadOpen, bz2err = %d", dbz2err);
-	if ((epf = fopen(argv[3], "r")) == NULL)
-		err(1, "fopen(%s)", argv[3]);
-	if (fseeko(epf, 32 + bzctrllen + bzdatalen, SEEK_SET))
-		err(1, "fseeko(%s, %lld)", argv[3],
-		    (long long)(32 + bzctrllen + bzdatalen));
-	if ((epfbz2 = BZ2_bzReadOpen(&ebz2err, epf, 0, 0, NULL, 0)) == NULL)
-		errx(1, "BZ2_bzReadOpen, bz2err = %d", ebz2err);
-
-	if(((fd=open(argv[1],O_RDONLY,0))<0) ||
-		((oldsize=lseek(fd,0,SEEK_END))==-1) ||
-		((old=malloc(oldsize+1))==NULL) ||
-		(lseek(fd,0,SEEK_SET)!=0) ||
-		(read(fd,old,oldsize)!=oldsize) ||
-		(close(fd)==-1)) err(1,"%s",argv[1]);
-	if((new=malloc(newsize+1))==NULL) err(1,NULL);
-
-	oldpos=0;newpos=0;
-	while(newpos<newsize) {
-		/* Read control data */
-		for(i=0;i<=2;i++) {
-			lenread = BZ2_bzRead(&cbz2err, cpfbz2, buf, 8);
-			if ((lenread < 8) || ((cbz2err != BZ_OK) &&
-			    (cbz2err != BZ_STREAM_END)))
-				errx(1, "Corrupt patch\n");
-			ctrl[i]=offtin(buf);
+	off_t offset;		/* Where the data written starts in the file */
+	off_t prevbase,prevlen;
+	int writebehind;
+};
+
+static int newwrite(void *opaque,off_t pos,const u_char *buf,size_t len)
+{
+	struct newfile *nf=opaque;
+	size_t i;
+	ssize_t n;
+
+	for(i=0;i<len;i+=n) {
+		if((n=pwrite(nf->fd,buf+i,MIN(len-i,IO_CHUNK),
+		    nf->offset+pos+i))<0) {
+			if(errno!=EINTR) err(1,"%s",nf->name);
+			n=0;
 		};
+	};
 
-		/* Sanity-check */
-		if(newpos+ctrl[0]>newsize)
-			errx(1,"Corrupt patch\n");
-
-		/* Read diff string */
-		lenread = BZ2_bzRead(&dbz2err, dpfbz2, new + newpos, ctrl[0]);
-		if ((lenread < ctrl[0]) ||
-		    ((dbz2err != BZ_OK) && (dbz2err != BZ_STREAM_END)))
-			errx(1, "Corrupt patch\n");
-
-		/* Add old data to diff string */
-		for(i=0;i<ctrl[0];i++)
-			if((oldpos+i>=0) && (oldpos+i<oldsize))
-				new[newpos+i]+=old[oldpos+i];
-
-		/* Adjust pointers */
-		newpos+=ctrl[0];
-		oldpos+=ctrl[0];
-
-		/* Sanity-check */
-		if(newpos+ctrl[1]>newsize)
-			errx(1,"Corrupt patch\n");
-
-		/* Read extra string */
-		lenread = BZ2_bzRead(&ebz2err, epfbz2, new + newpos, ctrl[1]);
-		if ((lenread < ctrl[1]) ||
-		    ((ebz2err != BZ_OK) && (ebz2err != BZ_STREAM_END)))
-			errx(1, "Corrupt patch\n");
-
-		/* Adjust pointers */
-		newpos+=ctrl[1];
-		oldpos+=ctrl[2];
-	};
-
-	/* Clean up the bzip2 reads */
-	BZ2_bzReadClose(&cbz2err, cpfbz2);
-	BZ2_bzReadClose(&dbz2err, dpfbz2);
-	BZ2_bzReadClose(&ebz2err, epfbz2);
-	if (fclose(cpf) || fclose(dpf) || fclose(epf))
-		err(1, "fclose(%s)", argv[3]);
-
-	/* Write the new file */
-	if(((fd=open(argv[2],O_CREAT|O_TRUNC|O_WRONLY,0666))<0) ||
-		(write(fd,new,newsize)!=newsize) || (close(fd)==-1))
-		err(1,"%s",argv[2]);
-
-	free(new);
-	free(old);
+#ifdef SYNC_FILE_RANGE_WRITE
+	pos+=nf->offset;
+	if(nf->writebehind && (len>0)) {
+		sync_file_range(nf->fd,pos,len,SYNC_FILE_RANGE_WRITE);
+		if(nf->prevlen>0) {
+			sync_file_range(nf->fd,nf->prevbase,nf->prevlen,
+			    SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|
+			    SYNC_FILE_RANGE_WAIT_AFTER);
+			posix_fadvise(nf->fd,nf->prevbase,nf->prevlen,
+			    POSIX_FADV_DONTNEED);
+		};
+		nf->prevbase=pos;
+		nf->prevlen=len;
+	};
+#endif
+
+	return 0;
+}
+
+/* Read back what newwrite() wrote, for repeats reaching further back
+	than the window */
+static int newread(void *opaque,off_t pos,u_char *buf,size_t len)
+{
+	struct newfile *nf=opaque;
+	size_t i;
+	ssize_t n;
+
+	for(i=0;i<len;i+=n) {
+		if((n=pread(nf->fd,buf+i,len-i,nf->offset+pos+i))<0) {
+			if(errno!=EINTR) err(1,"%s",nf->name);
+			n=0;
+		} else if(n==0)
+			errx(1,"%s: short read",nf->name);
+	};
+
+	return 0;
+}
+
+/* The checkpoint file and the new file it describes */
+struct ckpt {
+	const char *name;
+	char *tmp;
+	char *dir;		/* Where name is, to sync the rename */
+	struct newfile *nf;
+};
+
+/* Save a checkpoint once the new data it covers is on disk.  It goes
+	to a temporary file which is renamed over the last one, and the
+	rename is synced, so that a crash leaves one checkpoint or the
+	other */
+static int ckptsave(void *opaque,const u_char *state)
+{
+	struct ckpt *c=opaque;
+	int fd;
+
+	if(fsync(c->nf->fd)==-1)
+		err(1,"%s",c->nf->name);
+	if(((fd=open(c->tmp,O_CREAT|O_TRUNC|O_WRONLY,0666))<0) ||
+	    (write(fd,state,BSPATCH_STATELEN)!=BSPATCH_STATELEN) ||
+	    (fsync(fd)==-1) || (close(fd)==-1))
+		err(1,"%s",c->tmp);
+	if(rename(c->tmp,c->name)==-1)
+		err(1,"%s",c->name);
+	if(((fd=open(c->dir,O_RDONLY,0))<0) || (fsync(fd)==-1) ||
+	    (close(fd)==-1))
+		err(1,"%s",c->dir);
+
+	return 0;
+}
+
+/* Read the checkpoint saved in fname, if there is one */
+static int ckptload(const char *fname,u_char *state)
+{
+	int fd;
+
+	if((fd=open(fname,O_RDONLY,0))<0) {
+		if(errno==ENOENT) return 0;
+		err(1,"%s",fname);
+	};
+	if(read(fd,state,BSPATCH_STATELEN)!=BSPATCH_STATELEN)
+		errx(1,"%s: short checkpoint",fname);
+	if(close(fd)==-1)
+		err(1,"%s",fname);
+
+	return 1;
+}
+
+/* Patch fname in place, mapping old and new in the same pages.  The
+	file is left corrupt if this is interrupted */
+static int inplace(const char *fname,struct bspatch_ctx *ctx)
+{
+	off_t oldsize,newsize,size;
+	u_char *map;
+	int fd,e;
+
+	if(((fd=open(fname,O_RDWR,0))<0) ||
+		((oldsize=lseek(fd,0,SEEK_END))==-1))
+		err(1,"%s",fname);
+
+	newsize=bspatch_newsize(ctx);
+	size=MAX(oldsize,newsize);
+	if((size_t)size!=size)
+		errx(1,"%s: too large to patch in place",fname);
+	if((size>oldsize) && (ftruncate(fd,size)==-1))
+		err(1,"%s",fname);
+	map=NULL;
+	if((size>0) &&
+	    ((map=mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0))==
+	    MAP_FAILED))
+		err(1,"%s",fname);
+
+	e=bspatch_inplace(ctx,map,oldsize);
+
+	if((map!=NULL) && (munmap(map,size)==-1))
+		err(1,"%s",fname);
+	/* A file that is not the patch's old version is left as it was */
+	if((e==BSPATCH_EOLD) && (ftruncate(fd,oldsize)==-1))
+		err(1,"%s",fname);
+	if(e!=0)
+		return e;
+	if((ftruncate(fd,newsize)==-1) || (fsync(fd)==-1) || (close(fd)==-1))
+		err(1,"%s",fname);
+
+	return 0;
+}
+
+/* Parse a size with an optional k, m or g suffix */
+static off_t parsesize(const char *str)
+{
+	char *end;
+	off_t x;
+
+	x=strtoll(str,&end,10);
+	switch(*end) {
+	case 'g': case 'G': x*=1024;
+	/* FALLTHROUGH */
+	case 'm': case 'M': x*=1024;
+	/* FALLTHROUGH */
+	case 'k': case 'K': x*=1024;
+		end++;
+	};
+	if((end==str) || (*end!='\0') || (x<=0))
+		errx(1,"invalid size: %s",str);
+
+	return x;
+}
+
+/* Parse offset:length, each a size as above; the offset may be 0 */
+static void parserange(const char *str,off_t *off,off_t *len)
+{
+	char buf[32];
+	const char *colon;
+
+	if(((colon=strchr(str,':'))==NULL) ||
+	    (colon-str>=(off_t)sizeof(buf)))
+		errx(1,"invalid range: %s",str);
+	memcpy(buf,str,colon-str);
+	buf[colon-str]='\0';
+	*off=(strcmp(buf,"0")==0)?0:parsesize(buf);
+	*len=parsesize(colon+1);
+}
+
+/* The old files of a bundle, or from -M, mapped and read as if joined
+	end to end */
+struct oldset {
+	size_t n;
+	u_char **bufs;
+	off_t *start;		/* Where each file starts; start[n] is the end */
+	long pagesize;
+};
+
+/* The index of the last file in os starting at or before pos */
+static size_t setfind(const struct oldset *os,off_t pos)
+{
+	size_t lo,hi,mid;
+
+	for(lo=0,hi=os->n;hi-lo>1;) {
+		mid=(lo+hi)/2;
+		if(os->start[mid]<=pos) lo=mid; else hi=mid;
+	};
+
+	return lo;
+}
+
+static int setread(void *opaque,off_t pos,u_char *buf,size_t len)
+{
+	struct oldset *os=opaque;
+	size_t i;
+	off_t n;
+
+	for(i=setfind(os,pos);len>0;i++) {
+		if(i>=os->n)
+			return -1;
+		if((n=MIN(os->start[i+1]-pos,(off_t)len))<=0)
+			continue;
+		memcpy(buf,os->bufs[i]+(pos-os->start[i]),n);
+		buf+=n;
+		pos+=n;
+		len-=n;
+	};
+
+	return 0;
+}
+
+static void setwillneed(void *opaque,off_t pos,off_t len)
+{
+	struct oldset *os=opaque;
+	size_t i;
+	off_t lo,hi;
+
+	for(i=setfind(os,pos);(i<os->n)&&(os->start[i]<pos+len);i++) {
+		lo=MAX(pos,os->start[i])-os->start[i];
+		hi=MIN(pos+len,os->start[i+1])-os->start[i];
+		if(hi<=lo)
+			continue;
+		/* madvise() wants a page-aligned start */
+		lo-=(size_t)(os->bufs[i]+lo)&(os->pagesize-1);
+		if(madvise(os->bufs[i]+lo,hi-lo,MADV_WILLNEED)==-1)
+			err(1,"madvise");
+	};
+}
+
+/* Reject names in a bundle that would reach outside the tree */
+static int safename(const char *name)
+{
+	const char *p,*q;
+
+	if(*name=='/')
+		return 0;
+	for(p=name;;p=q+1) {
+		if((q=strchr(p,'/'))==NULL)
+			q=p+strlen(p);
+		if((q==p) || ((q-p==1) && (p[0]=='.')) ||
+		    ((q-p==2) && (p[0]=='.') && (p[1]=='.')))
+			return 0;
+		if(*q=='\0')
+			return 1;
+	};
+}
+
+/* Read the manifest entry at *p, of at most end-*p bytes, into size,
+	base for a new file (base being NULL for an old one) and a malloc'd
+	name, and move *p past it */
+static void bundleentry(const u_char **p,const u_char *end,off_t *size,
+	off_t *base,char **name,const char *fname)
+{
+	off_t len,n;
+
+	n=(base!=NULL)?24:16;
+	if((end-*p<n) || ((*size=offtin((u_char *)*p))<0) ||
+	    ((len=offtin((u_char *)*p+n-8))<=0) || (len>end-*p-n) ||
+	    (memchr(*p+n,'\0',len)!=NULL))
+		errx(1,"%s: corrupt bundle",fname);
+	if(base!=NULL)
+		*base=offtin((u_char *)*p+8);
+	if((*name=malloc(len+1))==NULL) err(1,NULL);
+	memcpy(*name,*p+n,len);
+	(*name)[len]='\0';
+	if(!safename(*name))
+		errx(1,"%s: unsafe name in bundle: %s",fname,*name);
+	*p+=n+len;
+}
+
+/* Make the directories leading to dir/name */
+static void mkparents(const char *dir,const char *name)
+{
+	char *path,*p;
+
+	if((path=malloc(strlen(dir)+strlen(name)+2))==NULL) err(1,NULL);
+	sprintf(path,"%s/%s",dir,name);
+	for(p=path+strlen(dir);(p=strchr(p+1,'/'))!=NULL;) {
+		*p='\0';
+		if((mkdir(path,0777)==-1) && (errno!=EEXIST))
+			err(1,"%s",path);
+		*p='/';
+	};
+	free(path);
+}
+
+/* Apply a bundle made with bsdiff -B to the files under olddir, making
+	the files under newdir; see bsformat.h */
+static void bundle(const char *fname,const char *olddir,const char *newdir,
+	struct bspatch_opts *opts)
+{
+	struct bspatch_input bin,old,one,patch,*in;
+	struct bspatch_output out;
+	struct bspatch_ctx *ctx;
+	struct patchpipe pp;
+	struct oldset os;
+	struct newfile nf;
+	struct stat sb;
+	const u_char *p,*end;
+	u_char *manifest,*checked;
+	off_t nold,nnew,hlen,mlen,size,base,pos;
+	unsigned int len;
+	char *name,*path;
+	size_t i;
+	int fd,e;
+
+	if(patchopen(&bin,&pp,fname) || (bin.size<BSBUNDLE_HEADERLEN) ||
+	    (memcmp(bin.buf,BSBUNDLE_MAGIC,8)!=0))
+		errx(1,"%s: not a bundle",fname);
+	nold=offtin((u_char *)bin.buf+8);
+	nnew=offtin((u_char *)bin.buf+16);
+	hlen=offtin((u_char *)bin.buf+24);
+	mlen=offtin((u_char *)bin.buf+32);
+	if((hlen<0) || (hlen>bin.size-BSBUNDLE_HEADERLEN) ||
+	    ((unsigned int)hlen!=hlen) || (mlen<0) ||
+	    ((unsigned int)mlen!=mlen) ||
+	    (nold<0) || (nnew<0) || (nold+nnew>mlen/16))
+		errx(1,"%s: corrupt bundle",fname);
+
+	/* Unpack the manifest */
+	if((manifest=malloc(mlen+1))==NULL) err(1,NULL);
+	len=mlen;
+	if((BZ2_bzBuffToBuffDecompress((char *)manifest,&len,
+	    (char *)bin.buf+BSBUNDLE_HEADERLEN,hlen,0,0)!=BZ_OK) ||
+	    (len!=mlen))
+		errx(1,"%s: corrupt bundle",fname);
+	p=manifest;
+	end=p+mlen;
+
+	/* Map every old file, checking that it is the size it was */
+	os.n=nold;
+	if(((os.bufs=calloc(nold+1,sizeof(*os.bufs)))==NULL) ||
+	    ((os.start=calloc(nold+1,sizeof(*os.start)))==NULL))
+		err(1,NULL);
+	for(i=0;i<os.n;i++) {
+		bundleentry(&p,end,&size,NULL,&name,fname);
+		if((path=malloc(strlen(olddir)+strlen(name)+2))==NULL)
+			err(1,NULL);
+		sprintf(path,"%s/%s",olddir,name);
+		if(((fd=open(path,O_RDONLY,0))<0) || (fstat(fd,&sb)==-1))
+			err(1,"%s",path);
+		if(!S_ISREG(sb.st_mode) || (sb.st_size!=size))
+			errx(1,"%s: not the file the bundle was made from",
+			    path);
+		if((size>0) && (((size_t)size!=size) ||
+		    ((os.bufs[i]=mmap(NULL,size,PROT_READ,MAP_PRIVATE,fd,0))==
+		    MAP_FAILED)))
+			err(1,"%s",path);
+		if(close(fd)==-1) err(1,"%s",path);
+		os.start[i+1]=os.start[i]+size;
+		free(path);
+		free(name);
+	};
+	memset(&old,0,sizeof(old));
+	old.size=os.start[os.n];
+	old.read=setread;
+	old.willneed=setwillneed;
+	old.opaque=&os;
+	os.pagesize=sysconf(_SC_PAGESIZE);
+
+	/* Make each new file from its patch, against all the old files,
+		one of them, or none.  An old digest is only checked the
+		first time the same old is used */
+	if((mkdir(newdir,0777)==-1) && (errno!=EEXIST))
+		err(1,"%s",newdir);
+	if((checked=calloc(nold+2,1))==NULL) err(1,NULL);
+	opts->lo=0;
+	opts->hi=-1;
+	for(pos=BSBUNDLE_HEADERLEN+hlen;nnew>0;nnew--,pos+=size) {
+		bundleentry(&p,end,&size,&base,&name,fname);
+		if((base<-2) || (base>=nold))
+			errx(1,"%s: corrupt bundle",fname);
+		if(size>bin.size-pos)
+			errx(1,"%s: truncated bundle",fname);
+		memset(&patch,0,sizeof(patch));
+		patch.buf=bin.buf+pos;
+		patch.size=size;
+		if((e=bspatch_open(&ctx,&patch))!=0)
+			errx(1,"%s: %s",name,bspatch_strerror(e));
+		in=&old;
+		if(base!=-1) {
+			memset(&one,0,sizeof(one));
+			one.buf=(const u_char *)"";
+			if((base>=0) && (os.bufs[base]!=NULL)) {
+				one.buf=os.bufs[base];
+				one.size=os.start[base+1]-os.start[base];
+				one.mapped=1;
+			};
+			in=&one;
+		};
+		opts->noverify=((base>=-1) && checked[base+1])?
+		    BSPATCH_NOVERIFY_OLD:0;
+
+		mkparents(newdir,name);
+		if((path=malloc(strlen(newdir)+strlen(name)+2))==NULL)
+			err(1,NULL);
+		sprintf(path,"%s/%s",newdir,name);
+		nf.name=path;
+		nf.offset=0;
+		if((nf.fd=open(path,O_CREAT|O_TRUNC|O_RDWR,0666))<0)
+			err(1,"%s",path);
+		nf.writebehind=(opts->window>0) &&
+		    (opts->window<bspatch_newsize(ctx));
+		nf.prevbase=nf.prevlen=0;
+		memset(&out,0,sizeof(out));
+		out.write=newwrite;
+		out.read=newread;
+		out.opaque=&nf;
+		if((e=bspatch_apply(ctx,in,&out,opts))!=0)
+			errx(1,"%s: %s",name,bspatch_strerror(e));
+		if(close(nf.fd)==-1) err(1,"%s",path);
+		if(base>=-1)
+			checked[base+1]=1;
+
+		bspatch_close(ctx);
+		free(path);
+		free(name);
+	};
+
+	for(i=0;i<os.n;i++)
+		if(os.bufs[i]!=NULL)
+			munmap(os.bufs[i],os.start[i+1]-os.start[i]);
+	free(checked);
+	free(os.bufs);
+	free(os.start);
+	free(manifest);
+	fileclose(&bin);
+}
+
+static void usage(void)
+{
+	errx(1,"usage: bspatch [-r] [-j threads] [-e offset:length] [-w window] "
+	    "oldfile newfile patchfile ...\n"
+	    "       bspatch [-r] [-j threads] [-w window] -c checkpoint "
+	    "[--resume] oldfile newfile patchfile ...\n"
+	    "       bspatch -i file patchfile\n"
+	    "       bspatch [-j threads] [-w window] -B olddir newdir "
+	    "bundle\n"
+	    "       bspatch [-j threads] [-e offset:length] [-w window] "
+	    "-M count oldfile ... newfile patchfile ...\n");
+}
+
+static const struct option longopts[]={
+	{ "resume",	no_argument,	NULL,	'R' },
+	{ NULL,		0,		NULL,	0 }
+};
+
+int main(int argc,char * argv[])
+{
+	struct bspatch_ctx **ctxs,*ctx;
+	struct bspatch_input *patches,*olds,old;
+	struct bspatch_output out;
+	struct bspatch_opts opts;
+	struct newfile nf;
+	struct oldfd ofd;
+	struct ckpt ckpt;
+	struct patchpipe *pps;
+	struct oldset os;
+	u_char state[BSPATCH_STATELEN];
+	char *end;
+	int ch,ip,dirs,ranged,resume,resumed,npatch,nold,i,e;
+	int *streamed;
+	const char *oldname,*newname;
+	char **patchnames;
+	off_t newsize,flags,lo,hi;
+
+	memset(&opts,0,sizeof(opts));
+	memset(&ckpt,0,sizeof(ckpt));
+	lo=0;hi=-1;
+	ip=dirs=0;
+	ranged=0;
+	resume=resumed=0;
+	nold=1;
+	while((ch=getopt_long(argc,argv,"BM:c:e:ij:rw:",longopts,NULL))!=-1) {
+		switch(ch) {
+		case 'B':
+			dirs=1;
+			break;
+		case 'M':
+			nold=strtol(optarg,&end,10);
+			if((*optarg=='\0') || (*end!='\0') || (nold<1))
+				errx(1,"invalid old file count: %s",optarg);
+			break;
+		case 'c':
+			ckpt.name=optarg;
+			break;
+		case 'e':
+			parserange(optarg,&lo,&hi);
+			hi+=lo;
+			break;
+		case 'i':
+			ip=1;
+			break;
+		case 'j':
+			opts.threads=strtol(optarg,&end,10);
+			if((*optarg=='\0') || (*end!='\0') || (opts.threads<0))
+				errx(1,"invalid thread count: %s",optarg);
+			break;
+		case 'r':
+			ranged=1;
+			break;
+		case 'R':
+			resume=1;
+			break;
+		case 'w':
+			opts.window=parsesize(optarg);
+			break;
+		default:
+			usage();
+		};
+	};
+	argc-=optind;
+	argv+=optind;
+	if((resume && (ckpt.name==NULL)) ||
+	    ((ckpt.name!=NULL) && (ip || (hi>=0))))
+		usage();
+	if((nold>1) && (dirs || ip || ranged))
+		usage();
+	if(dirs) {
+		if((argc!=3) || ip || ranged || (hi>=0) || (ckpt.name!=NULL))
+			usage();
+		bundle(argv[2],argv[0],argv[1],&opts);
+		return 0;
+	};
+	if(ip) {
+		if((argc!=2) || (hi>=0)) usage();
+		oldname=newname=argv[0];
+		patchnames=argv+1;
+		npatch=1;
+	} else {
+		if(argc<nold+2) usage();
+		oldname=argv[0];
+		newname=argv[nold];
+		patchnames=argv+nold+1;
+		npatch=argc-nold-1;
+	};
+
+	/* Map each patch file, or get ready to read it as it arrives, and
+		check its header; see bsformat.h.  With several, each is
+		applied to what the one before it makes, and only the last
+		can come from a pipe */
+	if(((patches=calloc(npatch,sizeof(*patches)))==NULL) ||
+	    ((pps=calloc(npatch,sizeof(*pps)))==NULL) ||
+	    ((streamed=calloc(npatch,sizeof(*streamed)))==NULL) ||
+	    ((ctxs=calloc(npatch,sizeof(*ctxs)))==NULL))
+		err(1,NULL);
+	for(i=0;i<npatch;i++) {
+		streamed[i]=patchopen(&patches[i],&pps[i],patchnames[i]);
+		if(streamed[i] && (i<npatch-1))
+			errx(1,"%s: only the last patch can be streamed",
+			    patchnames[i]);
+		if(patches[i].mapped)
+			madvise((void *)patches[i].buf,patches[i].size,
+			    MADV_WILLNEED);
+		if((e=bspatch_open(&ctxs[i],&patches[i]))!=0)
+			errx(1,"%s: %s",patchnames[i],bspatch_strerror(e));
+	};
+	ctx=ctxs[npatch-1];
+	newsize=bspatch_newsize(ctx);
+	flags=bspatch_flags(ctx);
+
+	/* With -e, only new[lo..hi) is reconstructed */
+	if(hi<0) hi=newsize;
+	if((lo>newsize) || (hi>newsize) || (hi<lo))
+		errx(1,"range is outside the new file");
+	if((hi-lo<newsize) && !(flags&BSDF_SEGMENTS))
+		errx(1,"-e needs a patch made with bsdiff -s");
+	if(ip && !(flags&BSDF_INPLACE))
+		errx(1,"-i needs a patch made with bsdiff -i");
+	if((ckpt.name!=NULL) && !(flags&BSDF_SEGMENTS))
+		errx(1,"-c needs a patch made with bsdiff -s");
+
+	/* With --resume, carry on from the last checkpoint if there is
+		one */
+	if(resume && ckptload(ckpt.name,state)) {
+		if((e=bspatch_resume(ctx,state,&lo))!=0)
+			errx(1,"%s: %s",ckpt.name,bspatch_strerror(e));
+		opts.resume=state;
+		resumed=1;
+	};
+	if(ckpt.name!=NULL) {
+		if((ckpt.tmp=malloc(strlen(ckpt.name)+5))==NULL)
+			err(1,NULL);
+		sprintf(ckpt.tmp,"%s.tmp",ckpt.name);
+		if((ckpt.dir=malloc(strlen(ckpt.name)+2))==NULL)
+			err(1,NULL);
+		strcpy(ckpt.dir,ckpt.name);
+		if((end=strrchr(ckpt.dir,'/'))==NULL)
+			strcpy(ckpt.dir,".");
+		else
+			end[(end==ckpt.dir)?1:0]='\0';
+		ckpt.nf=&nf;
+		opts.checkpoint=ckptsave;
+		opts.ckptopaque=&ckpt;
+		opts.ckptbytes=CKPT_INTERVAL;
+	};
+	opts.lo=lo;
+	opts.hi=hi;
+
+	if(ip) {
+		e=inplace(newname,ctx);
+	} else {
+		/* With -M, old is the old versions joined end to end, as
+			bsdiff -M joined them */
+		olds=NULL;
+		if(nold>1) {
+			os.n=nold;
+			if(((olds=calloc(nold,sizeof(*olds)))==NULL) ||
+			    ((os.bufs=calloc(nold,sizeof(*os.bufs)))==NULL) ||
+			    ((os.start=calloc(nold+1,sizeof(*os.start)))==NULL))
+				err(1,NULL);
+			for(i=0;i<nold;i++) {
+				fileopen(&olds[i],argv[i]);
+				os.bufs[i]=(u_char *)olds[i].buf;
+				os.start[i+1]=os.start[i]+olds[i].size;
+			};
+			memset(&old,0,sizeof(old));
+			old.size=os.start[nold];
+			old.read=setread;
+			old.willneed=setwillneed;
+			old.opaque=&os;
+			os.pagesize=sysconf(_SC_PAGESIZE);
+		} else if(!(ranged=oldopen(&old,&ofd,oldname,ranged)))
+			fileopen(&old,oldname);
+		nf.name=newname;
+		nf.offset=resumed?lo:0;
+		if((nf.fd=open(newname,resumed?O_RDWR:O_CREAT|O_TRUNC|O_RDWR,
+		    0666))<0)
+			err(1,"%s",newname);
+		nf.writebehind=(opts.window>0) && (opts.window<hi-lo);
+		nf.prevbase=nf.prevlen=0;
+		memset(&out,0,sizeof(out));
+		out.write=newwrite;
+		out.read=newread;
+		out.opaque=&nf;
+		e=bspatch_chain((const struct bspatch_ctx *const *)ctxs,
+		    npatch,&old,&out,&opts);
+		if(close(nf.fd)==-1) err(1,"%s",newname);
+		if(olds!=NULL) {
+			for(i=0;i<nold;i++)
+				fileclose(&olds[i]);
+			free(olds);
+			free(os.bufs);
+			free(os.start);
+		} else if(!ranged)
+			fileclose(&old);
+		else if(close(ofd.fd)==-1)
+			err(1,"%s",oldname);
+	};
+	if(e!=0)
+		errx(1,"%s\n",bspatch_strerror(e));
+
+	/* The new file is complete, so the checkpoint is of no more use */
+	if(ckpt.name!=NULL) {
+		if((unlink(ckpt.name)==-1) && (errno!=ENOENT))
+			err(1,"%s",ckpt.name);
+		free(ckpt.tmp);
+		free(ckpt.dir);
+	};
+	for(i=0;i<npatch;i++) {
+		bspatch_close(ctxs[i]);
+		if(!streamed[i])
+			fileclose(&patches[i]);
+		else if(close(pps[i].fd)==-1)
+			err(1,"%s",pps[i].name);
+	};
+	free(ctxs);
+	free(streamed);
+	free(pps);
+	free(patches);
 
 	return 0;
 }
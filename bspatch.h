@@ -0,0 +1,193 @@
+/*-
+ * Copyright 2026 The Android Open Source Project
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BSPATCH_H
+#define BSPATCH_H
+
+#include <sys/types.h>
+#include <stddef.h>
+
+/*
+ * libbspatch applies bsdiff(1) patches inside the calling process.
+ *
+ * bspatch_open() checks a patch's header and index and returns a
+ * context for it, which bspatch_apply() and bspatch_inplace() may then
+ * use any number of times, from any number of threads at once.  Inputs
+ * are memory buffers, used where they are without copying, or read
+ * callbacks; new data goes to a buffer or a write callback.  Functions
+ * return BSPATCH_OK or one of the negative error codes below, and never
+ * exit or print anything.
+ */
+
+#define BSPATCH_OK		0
+#define BSPATCH_ECORRUPT	(-1)	/* The patch is malformed */
+#define BSPATCH_EUNSUPPORTED	(-2)	/* The patch uses unknown flags */
+#define BSPATCH_ENOMEM		(-3)	/* Out of memory */
+#define BSPATCH_EIO		(-4)	/* A callback failed */
+#define BSPATCH_EINVAL		(-5)	/* Options do not fit the patch */
+#define BSPATCH_ETHREAD		(-6)	/* A thread could not be started */
+#define BSPATCH_EOLD		(-7)	/* Old does not match the patch's digest */
+#define BSPATCH_ENEW		(-8)	/* New does not match the patch's digest */
+#define BSPATCH_ESTATE		(-9)	/* A checkpoint is not for this patch */
+#define BSPATCH_ECHAIN		(-10)	/* Chained patches do not follow on */
+
+/* size bytes to read from: at buf or, if buf is NULL, through read(),
+	which must fill buf with the len bytes at pos and return 0, or
+	return -1.  Old data is read only where the patch uses it, in
+	ranges that are merged when they are close together, and if
+	willneed is not NULL it is told about each range some time before
+	it is read.  With opts->threads set, read() and willneed() may be
+	called from several threads at once.  A patch made with bsdiff -p
+	may instead be read front to back as it arrives, from a pipe say:
+	with sequential set, read() is only asked for the bytes following
+	those it last returned, and size is ignored */
+struct bspatch_input {
+	const unsigned char *buf;
+	off_t size;
+	int mapped;		/* buf is a file mapping and may be madvise()d */
+	int sequential;
+	int (*read)(void *opaque,off_t pos,unsigned char *buf,size_t len);
+	void (*willneed)(void *opaque,off_t pos,off_t len);
+	void *opaque;
+};
+
+/* Where new data goes: straight into buf, which must be big enough for
+	all of it, or if buf is NULL through a window that is handed to
+	write() whenever it fills up.  read() gets back data that has been
+	written; it is only needed by patches made with bsdiff -r, and then
+	only for repeats that reach back further than the window */
+struct bspatch_output {
+	unsigned char *buf;
+	int (*write)(void *opaque,off_t pos,const unsigned char *buf,
+	    size_t len);
+	int (*read)(void *opaque,off_t pos,unsigned char *buf,size_t len);
+	void *opaque;
+};
+
+/* Checks bspatch_apply() may skip on a patch made with bsdiff -d */
+#define BSPATCH_NOVERIFY_OLD	0x01
+#define BSPATCH_NOVERIFY_NEW	0x02
+
+/* Length of the checkpoint state passed to opts->checkpoint() */
+#define BSPATCH_STATELEN	160
+
+/* With a patch made with bsdiff -s, checkpoint() is called between
+	segments, at most once every ckptbytes bytes of new, with a state
+	recording that everything before the current segment has been
+	handed to new's write().  Once that data is safely stored, the
+	state may be saved too; it returns 0 to go on, or -1 to stop the
+	apply.  A later bspatch_apply() given the state in resume, and lo
+	from bspatch_resume(), reconstructs the rest of new, new digest
+	check included */
+struct bspatch_opts {
+	off_t window;		/* Bytes of new to buffer; 0 for all of it */
+	int threads;		/* As for bspatch -j */
+	off_t lo,hi;		/* Produce only new[lo..hi); hi<0 for the end */
+	int noverify;		/* BSPATCH_NOVERIFY_* */
+	int (*checkpoint)(void *opaque,const unsigned char *state);
+	void *ckptopaque;
+	off_t ckptbytes;
+	const unsigned char *resume;
+};
+
+struct bspatch_ctx;
+
+int bspatch_open(struct bspatch_ctx **ctxp,const struct bspatch_input *patch);
+void bspatch_close(struct bspatch_ctx *ctx);
+
+/* Size of new, and the BSDF_* flags of the patch (see bsformat.h) */
+off_t bspatch_newsize(const struct bspatch_ctx *ctx);
+off_t bspatch_flags(const struct bspatch_ctx *ctx);
+
+/* The digests of old and of new, 32 bytes each, carried by a patch
+	made with bsdiff -d, or NULL */
+const unsigned char *bspatch_digest(const struct bspatch_ctx *ctx);
+
+/* Reconstruct new, or with opts->hi>=0 part of it, from old.  opts may
+	be NULL.  A sequential patch is read as it is applied, so it can
+	only be applied once, whole, and without checkpoints.  If the patch
+	carries digests, all of old is hashed on a helper thread while the
+	patch is applied, even where the patch does not use it, and new is
+	hashed on another as it is produced unless only part of it is;
+	BSPATCH_EOLD is returned as soon as old is found not to match, and
+	BSPATCH_ENEW at the end if new does not.  old's read() may then be
+	called from the helper thread, and new data may already have been
+	written when either error is returned */
+int bspatch_apply(const struct bspatch_ctx *ctx,
+    const struct bspatch_input *old,const struct bspatch_output *new,
+    const struct bspatch_opts *opts);
+
+/* Apply the n patches of ctxs one after another, as if the new of each
+	were the old of the next, writing only the last new.  The versions
+	in between are made a few megabytes at a time, as the next patch
+	reads them, if their patches were made with bsdiff -s, and are
+	otherwise held whole in memory.  opts is for the last patch, and
+	only the last may be sequential.  Where patches carry digests, old
+	is checked against the first, the last new against the last, and
+	each patch's new digest against the old digest of the next,
+	BSPATCH_ECHAIN being returned before anything is done if they
+	differ */
+int bspatch_chain(const struct bspatch_ctx *const *ctxs,int n,
+    const struct bspatch_input *old,const struct bspatch_output *new,
+    const struct bspatch_opts *opts);
+
+/* Check that state, saved by opts->checkpoint(), belongs to the patch,
+	and return in pos the offset in new that it leaves off at */
+int bspatch_resume(const struct bspatch_ctx *ctx,const unsigned char *state,
+    off_t *pos);
+
+/* Where a run of new comes from: the patch's bytes added to old from
+	pos on (BSPATCH_RUN_OLD), where positions outside old count as
+	zeros; a copy of new from pos on, which comes before the run but may
+	overlap it (BSPATCH_RUN_NEW); or the patch's bytes alone
+	(BSPATCH_RUN_PATCH).  The patch's bytes are what bspatch_apply()
+	makes given an empty old */
+#define BSPATCH_RUN_OLD		0
+#define BSPATCH_RUN_NEW		1
+#define BSPATCH_RUN_PATCH	2
+
+struct bspatch_run {
+	off_t newpos,len;
+	int from;
+	off_t pos;
+};
+
+/* Call run() for each run of new in order, reading only the patch's
+	control data; run() returns 0 to go on, or -1 to stop with
+	BSPATCH_EIO.  The patch must not be sequential */
+int bspatch_runs(const struct bspatch_ctx *ctx,
+    int (*run)(void *opaque,const struct bspatch_run *r),void *opaque);
+
+/* Turn the oldsize bytes at buf into new, where buf has room for the
+	larger of the two; needs a patch made with bsdiff -i.  If the patch
+	carries digests, old is checked before buf is touched, and new
+	afterwards */
+int bspatch_inplace(const struct bspatch_ctx *ctx,unsigned char *buf,
+    off_t oldsize);
+
+const char *bspatch_strerror(int error);
+
+#endif /* !BSPATCH_H */
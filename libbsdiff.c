@@ -0,0 +1,1566 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2026 The Android Open Source Project
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+
+#include <bzlib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bsformat.h"
+#include "bsdiff.h"
+#include "sha256.h"
+
+#define MIN(x,y) (((x)<(y)) ? (x) : (y))
+
+static void split(off_t *I,off_t *V,off_t start,off_t len,off_t h)
+{
+	off_t i,j,k,x,tmp,jj,kk;
+
+	if(len<16) {
+		for(k=start;k<start+len;k+=j) {
+			j=1;x=V[I[k]+h];
+			for(i=1;k+i<start+len;i++) {
+				if(V[I[k+i]+h]<x) {
+					x=V[I[k+i]+h];
+					j=0;
+				};
+				if(V[I[k+i]+h]==x) {
+					tmp=I[k+j];I[k+j]=I[k+i];I[k+i]=tmp;
+					j++;
+				};
+			};
+			for(i=0;i<j;i++) V[I[k+i]]=k+j-1;
+			if(j==1) I[k]=-1;
+		};
+		return;
+	};
+
+	x=V[I[start+len/2]+h];
+	jj=0;kk=0;
+	for(i=start;i<start+len;i++) {
+		if(V[I[i]+h]<x) jj++;
+		if(V[I[i]+h]==x) kk++;
+	};
+	jj+=start;kk+=jj;
+
+	i=start;j=0;k=0;
+	while(i<jj) {
+		if(V[I[i]+h]<x) {
+			i++;
+		} else if(V[I[i]+h]==x) {
+			tmp=I[i];I[i]=I[jj+j];I[jj+j]=tmp;
+			j++;
+		} else {
+			tmp=I[i];I[i]=I[kk+k];I[kk+k]=tmp;
+			k++;
+		};
+	};
+
+	while(jj+j<kk) {
+		if(V[I[jj+j]+h]==x) {
+			j++;
+		} else {
+			tmp=I[jj+j];I[jj+j]=I[kk+k];I[kk+k]=tmp;
+			k++;
+		};
+	};
+
+	if(jj>start) split(I,V,start,jj-start,h);
+
+	for(i=0;i<kk-jj;i++) V[I[jj+i]]=kk-1;
+	if(jj==kk-1) I[jj]=-1;
+
+	if(start+len>kk) split(I,V,kk,start+len-kk,h);
+}
+
+static void qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize)
+{
+	off_t buckets[256];
+	off_t i,h,len;
+
+	for(i=0;i<256;i++) buckets[i]=0;
+	for(i=0;i<oldsize;i++) buckets[old[i]]++;
+	for(i=1;i<256;i++) buckets[i]+=buckets[i-1];
+	for(i=255;i>0;i--) buckets[i]=buckets[i-1];
+	buckets[0]=0;
+
+	for(i=0;i<oldsize;i++) I[++buckets[old[i]]]=i;
+	I[0]=oldsize;
+	for(i=0;i<oldsize;i++) V[i]=buckets[old[i]];
+	V[oldsize]=0;
+	for(i=1;i<256;i++) if(buckets[i]==buckets[i-1]+1) I[buckets[i]]=-1;
+	I[0]=-1;
+
+	for(h=1;I[0]!=-(oldsize+1);h+=h) {
+		len=0;
+		for(i=0;i<oldsize+1;) {
+			if(I[i]<0) {
+				len-=I[i];
+				i-=I[i];
+			} else {
+				if(len) I[i-len]=-len;
+				len=V[I[i]]+1-i;
+				split(I,V,i,len,h);
+				i+=len;
+				len=0;
+			};
+		};
+		if(len) I[i-len]=-len;
+	};
+
+	for(i=0;i<oldsize+1;i++) I[V[i]]=i;
+}
+
+static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
+{
+	off_t i;
+
+	for(i=0;(i<oldsize)&&(i<newsize);i++)
+		if(old[i]!=new[i]) break;
+
+	return i;
+}
+
+static off_t search(off_t *I,u_char *old,off_t oldsize,
+		u_char *new,off_t newsize,off_t st,off_t en,off_t *pos)
+{
+	off_t x,y;
+
+	if(en-st<2) {
+		x=matchlen(old+I[st],oldsize-I[st],new,newsize);
+		y=matchlen(old+I[en],oldsize-I[en],new,newsize);
+
+		if(x>y) {
+			*pos=I[st];
+			return x;
+		} else {
+			*pos=I[en];
+			return y;
+		}
+	};
+
+	x=st+(en-st)/2;
+	if(memcmp(old+I[x],new,MIN(oldsize-I[x],newsize))<0) {
+		return search(I,old,oldsize,new,newsize,x,en,pos);
+	} else {
+		return search(I,old,oldsize,new,newsize,st,x,pos);
+	};
+}
+
+/* The parts of old that a diff from bsdiff_diff_bases() may use: runs
+	of versions next to each other that are all used, each taking
+	old[start[i]..end[i]) to to[i] in the old the patch applies to */
+struct runs {
+	off_t *start,*end,*to;
+	int n;
+};
+
+/* Most suffixes runsearch() passes over on each side looking for one
+	in a run */
+#define RUN_MAXWALK	256
+
+/* The last run starting at or before pos */
+static int runfind(const struct runs *r,off_t pos)
+{
+	int lo,hi,mid;
+
+	for(lo=0,hi=r->n;hi-lo>1;) {
+		mid=(lo+hi)/2;
+		if(r->start[mid]<=pos) lo=mid; else hi=mid;
+	};
+
+	return lo;
+}
+
+/* search() for the runs of r: of the suffixes either side of where new
+	sorts, the nearest that start in a run, with their matches cut off
+	at the end of it */
+static off_t runsearch(const struct runs *r,off_t *I,u_char *old,
+		off_t oldsize,u_char *new,off_t newsize,off_t *pos)
+{
+	off_t st,en,x,i,len,best;
+	int k,side;
+
+	for(st=0,en=oldsize;en-st>=2;) {
+		x=st+(en-st)/2;
+		if(memcmp(old+I[x],new,MIN(oldsize-I[x],newsize))<0)
+			st=x;
+		else
+			en=x;
+	};
+
+	*pos=r->start[0];
+	best=0;
+	for(side=0;side<2;side++)
+		for(i=side?en:st;(i>=0)&&(i<=oldsize)&&
+		    (i>st-RUN_MAXWALK)&&(i<en+RUN_MAXWALK);i+=side?1:-1) {
+			k=runfind(r,I[i]);
+			if((I[i]<r->start[k]) || (I[i]>=r->end[k]))
+				continue;
+			len=matchlen(old+I[i],r->end[k]-I[i],new,newsize);
+			if((len>best) || ((len==best) && side)) {
+				*pos=I[i];
+				best=len;
+			};
+			break;
+		};
+
+	return best;
+}
+
+static off_t offtin(u_char *buf)
+{
+	off_t y;
+
+	y=buf[7]&0x7F;
+	y=y*256;y+=buf[6];
+	y=y*256;y+=buf[5];
+	y=y*256;y+=buf[4];
+	y=y*256;y+=buf[3];
+	y=y*256;y+=buf[2];
+	y=y*256;y+=buf[1];
+	y=y*256;y+=buf[0];
+
+	if(buf[7]&0x80) y=-y;
+
+	return y;
+}
+
+static void offtout(off_t x,u_char *buf)
+{
+	off_t y;
+
+	if(x<0) y=-x; else y=x;
+
+		buf[0]=y%256;y-=buf[0];
+	y=y/256;buf[1]=y%256;y-=buf[1];
+	y=y/256;buf[2]=y%256;y-=buf[2];
+	y=y/256;buf[3]=y%256;y-=buf[3];
+	y=y/256;buf[4]=y%256;y-=buf[4];
+	y=y/256;buf[5]=y%256;y-=buf[5];
+	y=y/256;buf[6]=y%256;y-=buf[6];
+	y=y/256;buf[7]=y%256;
+
+	if(x<0) buf[7]|=0x80;
+}
+
+static int varintout(u_int64_t x,u_char *buf)
+{
+	int n;
+
+	for(n=0;x>=0x80;n++) {
+		buf[n]=(x&0x7F)|0x80;
+		x>>=7;
+	};
+	buf[n++]=x;
+
+	return n;
+}
+
+static u_int64_t zigzag(off_t x)
+{
+	return ((u_int64_t)x<<1)^(u_int64_t)(x>>63);
+}
+
+/* Growable output buffer for blocks whose size is not known up front.
+	After a failed allocation, err is set and writes are dropped */
+struct wbuf {
+	u_char *buf;
+	off_t len,size;
+	int err;
+};
+
+static int wbufgrow(struct wbuf *b,off_t n)
+{
+	u_char *buf;
+	off_t size;
+
+	if(b->err) return -1;
+	if(b->len+n<=b->size) return 0;
+	for(size=b->size;b->len+n>size;size=size*2+256);
+	if((buf=realloc(b->buf,size))==NULL) {
+		b->err=1;
+		return -1;
+	};
+	b->buf=buf;
+	b->size=size;
+
+	return 0;
+}
+
+static void wbufvarint(struct wbuf *b,u_int64_t x)
+{
+	if(wbufgrow(b,VARINT_MAX)) return;
+	b->len+=varintout(x,b->buf+b->len);
+}
+
+static void wbufofft(struct wbuf *b,off_t x)
+{
+	if(wbufgrow(b,8)) return;
+	offtout(x,b->buf+b->len);
+	b->len+=8;
+}
+
+/* Shortest run of zeros worth ending a literal run for in a sparse diff
+	block; shorter ones cost more in run headers than they save */
+#define SPARSE_MINRUN	8
+
+/* Encode the diff block as alternating zero and literal runs */
+static void sparseout(struct wbuf *b,u_char *db,off_t dblen)
+{
+	off_t i,j,k,z;
+
+	for(i=0;i<dblen;i=j) {
+		for(z=i;(z<dblen)&&(db[z]==0);z++);
+		for(j=z;j<dblen;) {
+			if(db[j]!=0) {
+				j++;
+				continue;
+			};
+			for(k=j;(k<dblen)&&(db[k]==0);k++);
+			if((k-j>=SPARSE_MINRUN) || (k==dblen)) break;
+			j=k;
+		};
+		wbufvarint(b,z-i);
+		wbufvarint(b,j-z);
+		if(wbufgrow(b,j-z)) return;
+		memcpy(b->buf+b->len,db+z,j-z);
+		b->len+=j-z;
+	};
+}
+
+/* Shortest zero diff run or constant extra run worth its own COPY or
+	FILL operation */
+#define OPS_MINRUN	16
+
+/* Control block writer for BSDF_OPS.  The last operation is held back
+	so that runs of the same operation can be merged */
+struct opout {
+	struct wbuf *col[3];
+	int op;
+	off_t len,arg;
+};
+
+static void opflush(struct opout *o)
+{
+	if(o->op<0) return;
+	wbufvarint(o->col[0],((u_int64_t)o->len<<BSOP_BITS)|o->op);
+	if((o->op==BSOP_FILL) || (o->op==BSOP_COPYNEW))
+		wbufvarint(o->col[1],o->arg);
+	if(o->op==BSOP_SEEK) wbufvarint(o->col[2],zigzag(o->arg));
+	o->op=-1;
+}
+
+static void opemit(struct opout *o,int op,off_t len,off_t arg)
+{
+	if((op==BSOP_SEEK) ? (arg==0) : (len==0)) return;
+	if((op==o->op) && (((op!=BSOP_FILL) && (op!=BSOP_COPYNEW)) ||
+	    (arg==o->arg))) {
+		o->len+=len;
+		if(op==BSOP_SEEK) o->arg+=arg;
+		return;
+	};
+	opflush(o);
+	o->op=op;o->len=len;o->arg=arg;
+}
+
+/* Suffix array of new, used to find repeats within new for COPYNEW */
+struct selfidx {
+	u_char *new;
+	off_t newsize;
+	off_t *I,*V;
+	off_t lo;		/* Earliest position a repeat may come from */
+};
+
+/* Shortest repeat worth a COPYNEW, and how far to look either side of
+	a suffix in sorted order for an earlier occurrence of it */
+#define SELF_MINLEN	32
+#define SELF_MAXWALK	32
+
+/* Find the longest match for new[pos..end) that starts before pos.
+	Since V is the inverse of I, the nearest earlier suffix on each
+	side of pos in sorted order is the best candidate on that side */
+static off_t selfsearch(struct selfidx *x,off_t pos,off_t end,off_t *src)
+{
+	off_t r,k,i,len,best;
+	int d;
+
+	best=0;
+	for(d=-1;d<=1;d+=2) {
+		r=x->V[pos];
+		for(k=0;k<SELF_MAXWALK;k++) {
+			r+=d;
+			if((r<0) || (r>x->newsize)) break;
+			if(((i=x->I[r])>=pos) || (i<x->lo)) continue;
+			len=matchlen(x->new+i,x->newsize-i,x->new+pos,end-pos);
+			if(len>best) {
+				best=len;
+				*src=i;
+			};
+			break;
+		};
+	};
+
+	return best;
+}
+
+/* Emit FILLs and INSERTs for the len extra bytes at eb+in, packing the
+	bytes the INSERTs need down to eb+*out */
+static void litops(struct opout *o,u_char *eb,off_t *out,off_t in,off_t len)
+{
+	u_char *p;
+	off_t i,j,k;
+
+	p=eb+in;
+	for(i=0;i<len;i=j) {
+		for(j=i+1;(j<len)&&(p[j]==p[i]);j++);
+		if(j-i>=OPS_MINRUN) {
+			opemit(o,BSOP_FILL,j-i,p[i]);
+			continue;
+		};
+		for(j=i;j<len;j=k) {
+			for(k=j+1;(k<len)&&(p[k]==p[j]);k++);
+			if(k-j>=OPS_MINRUN) break;
+		};
+		memmove(eb+*out,p+i,j-i);
+		*out+=j-i;
+		opemit(o,BSOP_INSERT,j-i,0);
+	};
+}
+
+/* Emit the operations for one control triple whose diff and extra
+	bytes start at db+*dblen and eb+*eblen, the extra bytes being
+	new[newpos..newpos+extra).  Zero diff runs become COPYs, constant
+	extra runs FILLs and, if x is not NULL, repeats of earlier parts of
+	new COPYNEWs; the bytes still needed by ADDs and INSERTs are packed
+	down and *dblen and *eblen advanced past them */
+static void opstriple(struct opout *o,struct selfidx *x,
+	u_char *db,off_t *dblen,off_t lenf,
+	u_char *eb,off_t *eblen,off_t newpos,off_t extra,off_t seek)
+{
+	u_char *p;
+	off_t i,j,k,out,lit,len,src;
+
+	p=db+*dblen;out=*dblen;
+	for(i=0;i<lenf;i=j) {
+		for(j=i;(j<lenf)&&(p[j]==0);j++);
+		if(j-i>=OPS_MINRUN) {
+			opemit(o,BSOP_COPY,j-i,0);
+			continue;
+		};
+		for(j=i;j<lenf;) {
+			if(p[j]!=0) {
+				j++;
+				continue;
+			};
+			for(k=j;(k<lenf)&&(p[k]==0);k++);
+			if(k-j>=OPS_MINRUN) break;
+			j=k;
+		};
+		memmove(db+out,p+i,j-i);
+		out+=j-i;
+		opemit(o,BSOP_ADD,j-i,0);
+	};
+	*dblen=out;
+
+	p=eb+*eblen;out=*eblen;lit=0;
+	for(i=0;(x!=NULL)&&(i<extra);) {
+		/* Leave constant runs to FILL */
+		for(j=i+1;(j<extra)&&(p[j]==p[i]);j++);
+		if(j-i>=OPS_MINRUN) {
+			i=j;
+			continue;
+		};
+		len=selfsearch(x,newpos+i,newpos+extra,&src);
+		if(len<SELF_MINLEN) {
+			i++;
+			continue;
+		};
+		litops(o,eb,&out,*eblen+lit,i-lit);
+		opemit(o,BSOP_COPYNEW,len,newpos+i-src);
+		i+=len;
+		lit=i;
+	};
+	litops(o,eb,&out,*eblen+lit,extra-lit);
+	*eblen=out;
+
+	opemit(o,BSOP_SEEK,0,seek);
+}
+
+/* Largest slice of input handed to libbzip2 at once, whose counters
+	are unsigned ints, and how much compressed data to gather before
+	handing it to the output */
+#define BZ_CHUNK	(1024*1024*1024)
+#define ZBUF_SIZE	(64*1024)
+
+/* Patch writer.  Control data goes into cb[] (or into ops, with
+	BSDF_OPS) and diff and extra bytes into db and eb as triples come
+	in; all of it is compressed and written out at the end of each
+	body, which is the whole patch or, with BSDF_SEGMENTS, one segment.
+	With BSDF_STREAM each segment is gathered in memory and written out
+	behind its index entry.  The first error sticks in err and stops
+	all further output */
+struct patchout {
+	struct bsdiff_output *out;
+	off_t pos;		/* Where the next write goes */
+	struct bsdiff_output *dest;	/* With BSDF_STREAM: the patch, */
+	off_t destpos;		/* where its next segment goes, */
+	struct bsdiff_output frame;	/* and the segment being written */
+	u_char *zbuf;
+	int err;
+	off_t flags;
+	int compact;
+	struct selfidx *self;	/* NULL unless looking for COPYNEWs */
+	u_char *old,*new;
+	off_t oldsize;
+	u_char *db,*eb;
+	off_t dblen,eblen;	/* Bytes of db and eb in use */
+	off_t dbstart,ebstart;	/* Where the current body's bytes start */
+	struct wbuf cb[3],*cf[3];
+	struct opout ops;
+	off_t newpos,oldpos;	/* Where the next triple applies */
+	off_t newsize;
+	/* Segmenting state: segment size (0 for none), end of the
+		current segment, its number and the index being built */
+	off_t segsize,segend,seg;
+	u_char *index;
+	/* With BSDF_INPLACE, each segment's place in the order in which
+		they are to be applied */
+	off_t *rank;
+	/* The header, digests included, which is filled in at the end
+		unless it went out final with BSDF_STREAM, and the index */
+	u_char header[BSDIFF41_HEADERLEN+BSDIGEST_LEN];
+	off_t headerlen,datastart,idxlen;
+};
+
+/* Size of the memory sink's buffer when it holds len bytes: it grows
+	by doubling, so this never needs storing */
+static off_t sinksize(off_t len)
+{
+	off_t size;
+
+	for(size=65536;size<len;size*=2);
+
+	return size;
+}
+
+/* Store len bytes at pos in out */
+static int outwrite(struct bsdiff_output *out,off_t pos,const u_char *buf,
+	off_t len)
+{
+	u_char *nbuf;
+
+	if(len==0) return 0;
+	if(out->write!=NULL) {
+		if(out->write(out->opaque,pos,buf,len)!=0)
+			return BSDIFF_EIO;
+		return 0;
+	};
+
+	if(pos+len>out->len) {
+		if((out->buf==NULL) || (pos+len>sinksize(out->len))) {
+			if((nbuf=realloc(out->buf,sinksize(pos+len)))==NULL)
+				return BSDIFF_ENOMEM;
+			out->buf=nbuf;
+		};
+		out->len=pos+len;
+	};
+	memcpy(out->buf+pos,buf,len);
+
+	return 0;
+}
+
+/* Append len bytes to the patch */
+static void poutwrite(struct patchout *po,const u_char *buf,off_t len)
+{
+	if(po->err!=0) return;
+	po->err=outwrite(po->out,po->pos,buf,len);
+	po->pos+=len;
+}
+
+static void writebz2(struct patchout *po,u_char *buf,off_t len)
+{
+	bz_stream bz;
+	off_t n;
+	int bz2err;
+
+	if(po->err!=0) return;
+	memset(&bz,0,sizeof(bz));
+	if((bz2err=BZ2_bzCompressInit(&bz,9,0,0))!=BZ_OK) {
+		po->err=(bz2err==BZ_MEM_ERROR)?BSDIFF_ENOMEM:BSDIFF_EINVAL;
+		return;
+	};
+	do {
+		if((bz.avail_in==0) && (len>0)) {
+			n=MIN(len,BZ_CHUNK);
+			bz.next_in=(char *)buf;
+			bz.avail_in=n;
+			buf+=n;len-=n;
+		};
+		bz.next_out=(char *)po->zbuf;
+		bz.avail_out=ZBUF_SIZE;
+		bz2err=BZ2_bzCompress(&bz,(len>0)?BZ_RUN:BZ_FINISH);
+		if(bz2err<0) {
+			po->err=BSDIFF_EINVAL;
+			break;
+		};
+		poutwrite(po,po->zbuf,ZBUF_SIZE-bz.avail_out);
+	} while((po->err==0) && (bz2err!=BZ_STREAM_END));
+	BZ2_bzCompressEnd(&bz);
+}
+
+/* Compress and write the current body; lens gets the lengths of its
+	control, diff and extra blocks */
+static void bodywrite(struct patchout *po,off_t *lens)
+{
+	u_char colheader[16];
+	struct wbuf sb;
+	off_t start,pos;
+	int i;
+
+	opflush(&po->ops);
+	for(i=0;i<=2;i++)
+		if(po->cb[i].err && (po->err==0)) po->err=BSDIFF_ENOMEM;
+
+	/* Split columns are compressed separately, behind a small header
+		giving the compressed sizes of the first two */
+	start=po->pos;
+	if(po->flags&BSDF_COLUMNS) {
+		memset(colheader,0,sizeof(colheader));
+		poutwrite(po,colheader,16);
+		for(i=0;i<=2;i++) {
+			pos=po->pos;
+			writebz2(po,po->cb[i].buf,po->cb[i].len);
+			if(i<2) offtout(po->pos-pos, colheader + 8*i);
+		};
+		if(po->err==0)
+			po->err=outwrite(po->out,start,colheader,16);
+	} else
+		writebz2(po,po->cb[0].buf,po->cb[0].len);
+	lens[0]=po->pos-start;
+
+	start=po->pos;
+	if(po->flags&BSDF_SPARSE) {
+		memset(&sb,0,sizeof(sb));
+		sparseout(&sb,po->db+po->dbstart,po->dblen-po->dbstart);
+		if(sb.err && (po->err==0)) po->err=BSDIFF_ENOMEM;
+		writebz2(po,sb.buf,sb.len);
+		free(sb.buf);
+	} else
+		writebz2(po,po->db+po->dbstart,po->dblen-po->dbstart);
+	lens[1]=po->pos-start;
+
+	start=po->pos;
+	writebz2(po,po->eb+po->ebstart,po->eblen-po->ebstart);
+	lens[2]=po->pos-start;
+
+	for(i=0;i<=2;i++)
+		po->cb[i].len=0;
+	po->dbstart=po->dblen;
+	po->ebstart=po->eblen;
+}
+
+/* Write the current segment and fill in its index entry */
+static void segfinish(struct patchout *po)
+{
+	off_t lens[3];
+	int i;
+
+	bodywrite(po,lens);
+	for(i=0;i<3;i++)
+		offtout(lens[i],po->index+po->seg*BSSEG_ENTRYLEN+8+8*i);
+	if((po->dest==NULL) || (po->err!=0))
+		return;
+
+	if((po->err=outwrite(po->dest,po->destpos,
+	    po->index+po->seg*BSSEG_ENTRYLEN,BSSEG_ENTRYLEN))==0)
+		po->err=outwrite(po->dest,po->destpos+BSSEG_ENTRYLEN,
+		    po->frame.buf,po->pos);
+	po->destpos+=BSSEG_ENTRYLEN+po->pos;
+	po->frame.len=0;
+	po->pos=0;
+}
+
+/* Finish the current segment, if any, and start the next one */
+static void segnext(struct patchout *po)
+{
+	if(po->seg>=0) segfinish(po);
+	po->seg++;
+	offtout(po->oldpos,po->index+po->seg*BSSEG_ENTRYLEN);
+	po->segend=MIN(po->newsize,po->segend+po->segsize);
+	if(po->self!=NULL)
+		po->self->lo=po->newpos;
+}
+
+/* Emit the control triple (lenf,extra,seek), whose diff and extra
+	bytes have been put at db+dblen and eb+eblen.  When segmenting, the
+	triple is cut wherever it crosses into the next segment */
+static void triple(struct patchout *po,off_t lenf,off_t extra,off_t seek)
+{
+	off_t dbin,ebin,a,e,z;
+
+	dbin=po->dblen;
+	ebin=po->eblen;
+	for(;;) {
+		a=lenf;e=extra;
+		if(po->segsize>0) {
+			if(po->newpos==po->segend) {
+				/* A bare seek here just moves where the next
+					segment starts in old */
+				if(a+e==0) {
+					po->oldpos+=seek;
+					return;
+				};
+				segnext(po);
+			};
+			a=MIN(a,po->segend-po->newpos);
+			e=MIN(e,po->segend-po->newpos-a);
+		};
+		z=((a==lenf)&&(e==extra))?seek:0;
+
+		/* Earlier pieces may have been packed down */
+		memmove(po->db+po->dblen,po->db+dbin,a);
+		memmove(po->eb+po->eblen,po->eb+ebin,e);
+		dbin+=a;ebin+=e;
+
+		if(po->flags&BSDF_OPS) {
+			opstriple(&po->ops,po->self,po->db,&po->dblen,a,
+			    po->eb,&po->eblen,po->newpos+a,e,z);
+		} else {
+			if(po->compact) {
+				wbufvarint(po->cf[0],a);
+				wbufvarint(po->cf[1],e);
+				wbufvarint(po->cf[2],zigzag(z));
+			} else {
+				wbufofft(po->cf[0],a);
+				wbufofft(po->cf[1],e);
+				wbufofft(po->cf[2],z);
+			};
+			po->dblen+=a;
+			po->eblen+=e;
+		};
+		po->newpos+=a+e;
+		po->oldpos+=a+z;
+		lenf-=a;extra-=e;
+		if((lenf==0) && (extra==0)) break;
+	};
+}
+
+/* Nonzero if, when applying in place, new[newpos] cannot be made from
+	old[oldpos] because another segment has overwritten it by then */
+static int clobbered(struct patchout *po,off_t newpos,off_t oldpos)
+{
+	off_t reader,writer;
+
+	if((oldpos<0) || (oldpos>=MIN(po->oldsize,po->newsize)))
+		return 0;
+	reader=newpos/po->segsize;
+	writer=oldpos/po->segsize;
+
+	return (writer!=reader) && (po->rank[writer]<po->rank[reader]);
+}
+
+/* Emit the triple that makes new[newpos..newpos+lenf) from
+	old[oldpos..oldpos+lenf) and then inserts extra bytes, seeking by
+	seek afterwards.  Without old, new already holds the diff bytes.
+	When applying in place, the bytes that would be read from clobbered
+	old data are inserted instead */
+static void emit(struct patchout *po,off_t newpos,off_t oldpos,
+	off_t lenf,off_t extra,off_t seek)
+{
+	off_t i,j,k,p;
+
+	for(p=0,i=0;(po->rank!=NULL)&&(i<lenf);) {
+		if(!clobbered(po,newpos+i,oldpos+i)) {
+			i++;
+			continue;
+		};
+		for(j=i+1;(j<lenf)&&clobbered(po,newpos+j,oldpos+j);j++);
+		for(k=p;k<i;k++)
+			po->db[po->dblen+k-p]=po->new[newpos+k]-po->old[oldpos+k];
+		memcpy(po->eb+po->eblen,po->new+newpos+i,j-i);
+		triple(po,i-p,j-i,j-i);
+		p=i=j;
+	};
+
+	if(po->old!=NULL) {
+		for(k=p;k<lenf;k++)
+			po->db[po->dblen+k-p]=
+			    po->new[newpos+k]-po->old[oldpos+k];
+	} else
+		memcpy(po->db+po->dblen,po->new+newpos+p,lenf-p);
+	memcpy(po->eb+po->eblen,po->new+newpos+lenf,extra);
+	triple(po,lenf-p,extra,seek);
+}
+
+/* A triple as found by the scan, kept until the order for applying
+	in place is known */
+struct trip {
+	off_t newpos,oldpos,lenf,extra,seek;
+};
+
+/* Segment from reads w bytes of old where segment to is written */
+struct edge {
+	off_t from,to,w;
+};
+
+static int edgecmp(const void *a,const void *b)
+{
+	const struct edge *x=a,*y=b;
+
+	if(x->from!=y->from) return (x->from<y->from)?-1:1;
+	if(x->to!=y->to) return (x->to<y->to)?-1:1;
+	return 0;
+}
+
+/* Order the nseg segments so that as few old bytes as possible are
+	overwritten before they are read, and set rank[] accordingly;
+	returns -1 if out of memory.
+	A segment must come before every segment whose part of old it
+	reads; where that is impossible because of a cycle, the segment
+	with the fewest such bytes still waiting to be read goes next,
+	and emit() turns those reads into inserts */
+static int inplaceorder(struct patchout *po,struct trip *t,off_t nt,
+	off_t nseg)
+{
+	struct edge *e,*ebuf;
+	off_t ne,size,i,j,k,n,lim,best;
+	off_t *first,*indeg,*inw,*queue,qh,qt,done;
+	char *ran;
+
+	/* Collect and merge the edges */
+	e=NULL;ne=0;size=0;
+	lim=MIN(po->oldsize,po->newsize);
+	for(i=0;i<nt;i++) {
+		for(j=0;j<t[i].lenf;j+=n) {
+			k=t[i].oldpos+j;
+			if(k<0) {
+				n=MIN(t[i].lenf-j,-k);
+				continue;
+			};
+			if(k>=lim) break;
+			n=MIN(t[i].lenf-j,lim-k);
+			n=MIN(n,po->segsize-k%po->segsize);
+			n=MIN(n,po->segsize-(t[i].newpos+j)%po->segsize);
+			if(k/po->segsize==(t[i].newpos+j)/po->segsize)
+				continue;
+			if(ne==size) {
+				size=size*2+1024;
+				if((ebuf=realloc(e,size*sizeof(*e)))==NULL) {
+					free(e);
+					return -1;
+				};
+				e=ebuf;
+			};
+			e[ne].from=(t[i].newpos+j)/po->segsize;
+			e[ne].to=k/po->segsize;
+			e[ne].w=n;
+			ne++;
+		};
+	};
+	qsort(e,ne,sizeof(*e),edgecmp);
+	for(i=0,j=0;i<ne;i++) {
+		if((j>0) && (edgecmp(&e[j-1],&e[i])==0))
+			e[j-1].w+=e[i].w;
+		else
+			e[j++]=e[i];
+	};
+	ne=j;
+
+	first=calloc(nseg+1,sizeof(off_t));
+	indeg=calloc(nseg+1,sizeof(off_t));
+	inw=calloc(nseg+1,sizeof(off_t));
+	queue=malloc((nseg+1)*sizeof(off_t));
+	ran=calloc(nseg+1,1);
+	if((first==NULL) || (indeg==NULL) || (inw==NULL) || (queue==NULL) ||
+	    (ran==NULL)) {
+		done=-1;
+		goto out;
+	};
+	for(i=0;i<ne;i++) {
+		first[e[i].from+1]++;
+		indeg[e[i].to]++;
+		inw[e[i].to]+=e[i].w;
+	};
+	for(i=0;i<nseg;i++)
+		first[i+1]+=first[i];
+
+	/* Kahn's algorithm, forcing the cheapest segment on a cycle */
+	qh=qt=0;
+	for(i=0;i<nseg;i++)
+		if(indeg[i]==0) queue[qt++]=i;
+	for(done=0;done<nseg;done++) {
+		if(qh==qt) {
+			for(i=0,best=-1;i<nseg;i++)
+				if(!ran[i] && ((best<0) || (inw[i]<inw[best])))
+					best=i;
+			queue[qt++]=best;
+		};
+		i=queue[qh++];
+		ran[i]=1;
+		po->rank[i]=done;
+		for(k=first[i];k<first[i+1];k++) {
+			j=e[k].to;
+			inw[j]-=e[k].w;
+			if((--indeg[j]==0) && !ran[j])
+				queue[qt++]=j;
+		};
+	};
+	done=0;
+
+out:
+	free(e);
+	free(first);
+	free(indeg);
+	free(inw);
+	free(queue);
+	free(ran);
+
+	return done;
+}
+
+/* Segment size for BSDF_INPLACE and BSDF_STREAM without one given */
+#define DEFAULT_SEGSIZE	(1024*1024)
+
+/* Check opts and work out the flags, whether the header is compact,
+	and the segment size that a patch of newsize bytes gets */
+static int optsparse(const struct bsdiff_opts *opts,off_t newsize,
+	off_t *flagsp,int *compactp,off_t *segsizep)
+{
+	off_t flags,segsize;
+
+	flags=opts->flags;
+	segsize=opts->segsize;
+	if(opts->selfref)
+		flags|=BSDF_OPS;
+	if(flags&(BSDF_INPLACE|BSDF_STREAM))
+		flags|=BSDF_SEGMENTS;
+	if((flags&~(off_t)BSDF_KNOWN) || (segsize<0) || (newsize<0) ||
+	    (opts->minjump<0) ||
+	    ((segsize>0) && !(flags&BSDF_SEGMENTS)) ||
+	    ((flags&BSDF_INPLACE) && (flags&BSDF_STREAM)))
+		return BSDIFF_EINVAL;
+	if((flags&(BSDF_INPLACE|BSDF_STREAM)) && (segsize==0))
+		segsize=DEFAULT_SEGSIZE;
+	if((flags&BSDF_SEGMENTS) && (segsize==0))
+		return BSDIFF_EINVAL;
+
+	*flagsp=flags;
+	*compactp=opts->compact || (flags!=0);
+	*segsizep=segsize;
+
+	return 0;
+}
+
+/* Set po up to write a patch of newsize bytes to out, and write as much
+	of the header as is known; with BSDF_DIGEST, digest holds the
+	digests of old and new */
+static int pobegin(struct patchout *po,off_t flags,int compact,
+	off_t segsize,off_t newsize,const u_char *digest,
+	struct bsdiff_output *out)
+{
+	off_t nseg;
+	int i;
+
+	memset(po,0,sizeof(*po));
+	if(((po->db=malloc(newsize+1))==NULL) ||
+		((po->eb=malloc(newsize+1))==NULL) ||
+		((po->zbuf=malloc(ZBUF_SIZE))==NULL))
+		return po->err=BSDIFF_ENOMEM;
+	for(i=0;i<=2;i++)
+		po->ops.col[i]=po->cf[i]=
+		    (flags&BSDF_COLUMNS)?&po->cb[i]:&po->cb[0];
+	po->ops.op=-1;
+	po->out=out;
+	po->flags=flags;
+	po->compact=compact;
+	po->newsize=newsize;
+	po->seg=-1;
+
+	/* With BSDF_SEGMENTS, new is cut into nseg segments, listed in an
+		index that follows the header, and with BSDF_INPLACE the
+		index is followed by the order in which to apply them */
+	if(flags&BSDF_SEGMENTS) {
+		po->segsize=segsize;
+		nseg=(newsize+segsize-1)/segsize;
+		po->idxlen=nseg*(BSSEG_ENTRYLEN+((flags&BSDF_INPLACE)?8:0));
+		if((po->index=calloc(po->idxlen+1,1))==NULL)
+			return po->err=BSDIFF_ENOMEM;
+	};
+
+	/* With BSDF_STREAM the index entries go out with the segments,
+		and the header is final from the start */
+	if(flags&BSDF_STREAM)
+		po->idxlen=0;
+
+	/* Header is
+		0	8	 "BSDIFF40"
+		8	8	length of bzip2ed ctrl block
+		16	8	length of bzip2ed diff block
+		24	8	length of new file */
+	/* File is
+		0	32	Header
+		32	??	Bzip2ed ctrl block
+		??	??	Bzip2ed diff block
+		??	??	Bzip2ed extra block */
+	/* When compact, the header is the 40-byte BSDIFF41 one, which
+		carries a flags word in front of the same three lengths; see
+		bsformat.h.  With BSDF_SEGMENTS the first two lengths are
+		replaced by those of the index and of a segment */
+	if(compact) {
+		po->headerlen=BSDIFF41_HEADERLEN;
+		memcpy(po->header,BSDIFF41_MAGIC,8);
+		offtout(flags, po->header + 8);
+	} else {
+		po->headerlen=BSDIFF40_HEADERLEN;
+		memcpy(po->header,BSDIFF40_MAGIC,8);
+	};
+	offtout(0, po->header + po->headerlen - 24);
+	offtout((flags&BSDF_STREAM)?segsize:0, po->header + po->headerlen - 16);
+	offtout(newsize, po->header + po->headerlen - 8);
+
+	/* With BSDF_DIGEST the digests of old and new follow, and the
+		rest of the patch starts after them */
+	po->datastart=po->headerlen;
+	if(flags&BSDF_DIGEST) {
+		memcpy(po->header+po->headerlen,digest,BSDIGEST_LEN);
+		po->datastart+=BSDIGEST_LEN;
+	};
+	poutwrite(po,po->header,po->datastart);
+	poutwrite(po,po->index,po->idxlen);
+	if(flags&BSDF_STREAM) {
+		po->dest=out;
+		po->destpos=po->pos;
+		po->out=&po->frame;
+		po->pos=0;
+	};
+
+	return po->err;
+}
+
+/* Write the last or only body, then go back and fill in the header and
+	the index, which a stream has already written */
+static int poend(struct patchout *po)
+{
+	off_t blens[3];
+	u_char *h;
+
+	h=po->header+po->headerlen;
+	if(po->flags&BSDF_SEGMENTS) {
+		if(po->seg>=0) segfinish(po);
+		offtout(po->idxlen, h - 24);
+		offtout(po->segsize, h - 16);
+	} else {
+		bodywrite(po,blens);
+		offtout(blens[0], h - 24);
+		offtout(blens[1], h - 16);
+	};
+	if((po->err==0) && !(po->flags&BSDF_STREAM)) {
+		po->err=outwrite(po->out,0,po->header,po->datastart);
+		if(po->err==0)
+			po->err=outwrite(po->out,po->datastart,po->index,
+			    po->idxlen);
+	};
+
+	return po->err;
+}
+
+static void pofree(struct patchout *po)
+{
+	int i;
+
+	for(i=0;i<=2;i++)
+		free(po->cb[i].buf);
+	free(po->db);
+	free(po->eb);
+	free(po->zbuf);
+	free(po->frame.buf);
+	free(po->index);
+	free(po->rank);
+}
+
+/* The sorted suffixes of old, and old's digest for BSDF_DIGEST, which
+	is taken once here rather than by every diff against the index */
+struct bsdiff_index {
+	u_char *old;
+	off_t oldsize;
+	off_t *I;
+	u_char digest[SHA256_LEN];
+};
+
+static void indexdigest(struct bsdiff_index *idx)
+{
+	struct bs_sha256 sha;
+
+	bs_sha256_init(&sha);
+	bs_sha256_update(&sha,idx->old,idx->oldsize);
+	bs_sha256_final(&sha,idx->digest);
+}
+
+int bsdiff_index_build(struct bsdiff_index **idxp,const unsigned char *old,
+    off_t oldsize)
+{
+	struct bsdiff_index *idx;
+	off_t *V;
+
+	if(oldsize<0)
+		return BSDIFF_EINVAL;
+	if((idx=malloc(sizeof(*idx)))==NULL)
+		return BSDIFF_ENOMEM;
+	idx->old=(u_char *)old;
+	idx->oldsize=oldsize;
+	if(((idx->I=malloc((oldsize+1)*sizeof(off_t)))==NULL) ||
+		((V=malloc((oldsize+1)*sizeof(off_t)))==NULL)) {
+		free(idx->I);
+		free(idx);
+		return BSDIFF_ENOMEM;
+	};
+
+	qsufsort(idx->I,V,idx->old,oldsize);
+	indexdigest(idx);
+
+	free(V);
+	*idxp=idx;
+	return 0;
+}
+
+/* A saved index is
+	0	8	"BSINDEX1"
+	8	8	oldsize
+	16	8	I[0]
+	...
+	8*(oldsize+2)	8	I[oldsize]
+   with every field an 8-byte sign-magnitude integer, like the fields
+   of a patch header */
+#define INDEX_MAGIC	"BSINDEX1"
+
+int bsdiff_index_save(const struct bsdiff_index *idx,
+    struct bsdiff_output *out)
+{
+	u_char buf[8192];
+	off_t i,pos,n;
+	int e;
+
+	memcpy(buf,INDEX_MAGIC,8);
+	offtout(idx->oldsize,buf+8);
+	if((e=outwrite(out,0,buf,16))!=0)
+		return e;
+	pos=16;
+	for(i=0;i<=idx->oldsize;i+=n) {
+		for(n=0;(n<(off_t)sizeof(buf)/8)&&(i+n<=idx->oldsize);n++)
+			offtout(idx->I[i+n],buf+8*n);
+		if((e=outwrite(out,pos,buf,8*n))!=0)
+			return e;
+		pos+=8*n;
+	};
+
+	return 0;
+}
+
+int bsdiff_index_load(struct bsdiff_index **idxp,const unsigned char *old,
+    off_t oldsize,const unsigned char *buf,off_t len)
+{
+	struct bsdiff_index *idx;
+	off_t i;
+
+	if(oldsize<0)
+		return BSDIFF_EINVAL;
+	if((len<16) || (memcmp(buf,INDEX_MAGIC,8)!=0) ||
+	    (offtin((u_char *)buf+8)!=oldsize) || ((len-16)/8!=oldsize+1) ||
+	    ((len-16)%8!=0))
+		return BSDIFF_ECORRUPT;
+	if((idx=malloc(sizeof(*idx)))==NULL)
+		return BSDIFF_ENOMEM;
+	if((idx->I=malloc((oldsize+1)*sizeof(off_t)))==NULL) {
+		free(idx);
+		return BSDIFF_ENOMEM;
+	};
+	idx->old=(u_char *)old;
+	idx->oldsize=oldsize;
+
+	/* search() reads old+I[i] for every entry it visits, so the
+		entries must all be in range even if they are wrong */
+	for(i=0;i<=oldsize;i++) {
+		idx->I[i]=offtin((u_char *)buf+16+8*i);
+		if((idx->I[i]<0) || (idx->I[i]>oldsize)) {
+			bsdiff_index_free(idx);
+			return BSDIFF_ECORRUPT;
+		};
+	};
+	indexdigest(idx);
+
+	*idxp=idx;
+	return 0;
+}
+
+void bsdiff_index_free(struct bsdiff_index *idx)
+{
+	if(idx==NULL) return;
+	free(idx->I);
+	free(idx);
+}
+
+/* Diff new against idx, or with r against just the runs of it, whose
+	positions are moved to where they are in the patch's old */
+static int diff(const struct bsdiff_index *idx,const struct runs *r,
+    const unsigned char *newbuf,off_t newsize,const struct bsdiff_opts *opts,
+    struct bsdiff_output *out)
+{
+	struct bsdiff_opts defopts;
+	u_char *old,*new;
+	off_t oldsize;
+	off_t *I;
+	off_t scan,pos,len;
+	off_t lastscan,lastpos,lastoffset;
+	off_t lastend,lastto,posstart,posto;
+	off_t oldscore,scsc,minjump;
+	off_t s,Sf,lenf,Sb,lenb;
+	off_t overlap,Ss,lens;
+	off_t i;
+	struct patchout po;
+	struct selfidx self;
+	u_char digest[BSDIGEST_LEN];
+	struct bs_sha256 sha;
+	int compact,selfref,inplace,run,e;
+	off_t flags,segsize,nseg;
+	struct trip *trips,*ntrip;
+	off_t ntrips,tripsize;
+
+	if(opts==NULL) {
+		memset(&defopts,0,sizeof(defopts));
+		opts=&defopts;
+	};
+	selfref=opts->selfref;
+	if((e=optsparse(opts,newsize,&flags,&compact,&segsize))!=0)
+		return e;
+	inplace=(flags&BSDF_INPLACE)!=0;
+	minjump=(opts->minjump>0)?opts->minjump:8;
+	if(inplace && (r!=NULL))
+		return BSDIFF_EINVAL;
+
+	old=idx->old;
+	oldsize=idx->oldsize;
+	I=idx->I;
+	new=(u_char *)newbuf;
+
+	memset(&po,0,sizeof(po));
+	memset(&self,0,sizeof(self));
+	trips=NULL;
+	ntrips=tripsize=0;
+
+	/* With selfref, also sort new so that repeats within it can be
+		found */
+	if(selfref) {
+		self.new=new;
+		self.newsize=newsize;
+		self.lo=0;
+		if(((self.I=malloc((newsize+1)*sizeof(off_t)))==NULL) ||
+			((self.V=malloc((newsize+1)*sizeof(off_t)))==NULL)) {
+			po.err=BSDIFF_ENOMEM;
+			goto done;
+		};
+		qsufsort(self.I,self.V,new,newsize);
+	};
+
+	/* With BSDF_DIGEST the digests of old and new go in the header */
+	if(flags&BSDF_DIGEST) {
+		if(r==NULL)
+			memcpy(digest,idx->digest,SHA256_LEN);
+		else {
+			bs_sha256_init(&sha);
+			for(i=0;i<r->n;i++)
+				bs_sha256_update(&sha,old+r->start[i],
+				    r->end[i]-r->start[i]);
+			bs_sha256_final(&sha,digest);
+		};
+		bs_sha256_init(&sha);
+		bs_sha256_update(&sha,new,newsize);
+		bs_sha256_final(&sha,digest+SHA256_LEN);
+	};
+	if(pobegin(&po,flags,compact,segsize,newsize,digest,out)!=0)
+		goto done;
+	po.self=selfref?&self:NULL;
+	po.old=old;
+	po.new=new;
+	po.oldsize=oldsize;
+
+	/* Compute the differences, collecting ctrl as we go.  Matches and
+		their extensions stay within old, or within the run they
+		start in, whose ends are lastend and posstart */
+	scan=0;len=0;
+	lastscan=0;lastpos=0;lastoffset=0;
+	lastend=oldsize;lastto=posstart=posto=0;pos=0;run=0;
+	if(r!=NULL) {
+		pos=lastpos=lastoffset=r->start[0];
+		lastend=r->end[0];
+		lastto=r->to[0]-r->start[0];
+	};
+	while((scan<newsize) && (po.err==0)) {
+		oldscore=0;
+
+		for(scsc=scan+=len;scan<newsize;scan++) {
+			if(r==NULL)
+				len=search(I,old,oldsize,new+scan,newsize-scan,
+					0,oldsize,&pos);
+			else
+				len=runsearch(r,I,old,oldsize,new+scan,
+					newsize-scan,&pos);
+
+			for(;scsc<scan+len;scsc++)
+			if((scsc+lastoffset<lastend) &&
+				(old[scsc+lastoffset] == new[scsc]))
+				oldscore++;
+
+			if(((len==oldscore) && (len!=0)) || 
+				(len>oldscore+minjump)) break;
+
+			if((scan+lastoffset<lastend) &&
+				(old[scan+lastoffset] == new[scan]))
+				oldscore--;
+		};
+
+		if(r!=NULL) {
+			run=runfind(r,pos);
+			posstart=r->start[run];
+			posto=r->to[run]-r->start[run];
+		};
+
+		if((len!=oldscore) || (scan==newsize)) {
+			s=0;Sf=0;lenf=0;
+			for(i=0;(lastscan+i<scan)&&(lastpos+i<lastend);) {
+				if(old[lastpos+i]==new[lastscan+i]) s++;
+				i++;
+				if(s*2-i>Sf*2-lenf) { Sf=s; lenf=i; };
+			};
+
+			lenb=0;
+			if(scan<newsize) {
+				s=0;Sb=0;
+				for(i=1;(scan>=lastscan+i)&&(pos-i>=posstart);i++) {
+					if(old[pos-i]==new[scan-i]) s++;
+					if(s*2-i>Sb*2-lenb) { Sb=s; lenb=i; };
+				};
+			};
+
+			if(lastscan+lenf>scan-lenb) {
+				overlap=(lastscan+lenf)-(scan-lenb);
+				s=0;Ss=0;lens=0;
+				for(i=0;i<overlap;i++) {
+					if(new[lastscan+lenf-overlap+i]==
+					   old[lastpos+lenf-overlap+i]) s++;
+					if(new[scan-lenb+i]==
+					   old[pos-lenb+i]) s--;
+					if(s>Ss) { Ss=s; lens=i+1; };
+				};
+
+				lenf+=lens-overlap;
+				lenb-=lens;
+			};
+
+			if(inplace) {
+				/* Hold on to it until the order is known */
+				if(ntrips==tripsize) {
+					tripsize=tripsize*2+1024;
+					if((ntrip=realloc(trips,
+					    tripsize*sizeof(*trips)))==NULL) {
+						po.err=BSDIFF_ENOMEM;
+						goto done;
+					};
+					trips=ntrip;
+				};
+				trips[ntrips].newpos=lastscan;
+				trips[ntrips].oldpos=lastpos;
+				trips[ntrips].lenf=lenf;
+				trips[ntrips].extra=(scan-lenb)-(lastscan+lenf);
+				trips[ntrips].seek=(pos-lenb)-(lastpos+lenf);
+				ntrips++;
+			} else
+				emit(&po,lastscan,lastpos,lenf,
+				    (scan-lenb)-(lastscan+lenf),
+				    (pos-lenb+posto)-(lastpos+lenf+lastto));
+
+			lastscan=scan-lenb;
+			lastpos=pos-lenb;
+			lastoffset=pos-scan;
+			if(r!=NULL) {
+				lastend=r->end[run];
+				lastto=posto;
+			};
+		};
+	};
+
+	/* With BSDF_INPLACE, order the segments, then emit the triples
+		with whatever they would read after it was overwritten
+		turned into inserts */
+	if(inplace && (po.err==0)) {
+		nseg=(newsize+segsize-1)/segsize;
+		if(((po.rank=malloc((nseg+1)*sizeof(off_t)))==NULL) ||
+		    (inplaceorder(&po,trips,ntrips,nseg)!=0)) {
+			po.err=BSDIFF_ENOMEM;
+			goto done;
+		};
+		for(i=0;i<nseg;i++)
+			offtout(i,po.index+nseg*BSSEG_ENTRYLEN+8*po.rank[i]);
+		for(i=0;(i<ntrips)&&(po.err==0);i++)
+			emit(&po,trips[i].newpos,trips[i].oldpos,trips[i].lenf,
+			    trips[i].extra,trips[i].seek);
+	};
+
+	poend(&po);
+
+done:
+	/* Free the memory we used */
+	pofree(&po);
+	free(trips);
+	free(self.I);
+	free(self.V);
+
+	return po.err;
+}
+
+int bsdiff_diff(const struct bsdiff_index *idx,const unsigned char *newbuf,
+    off_t newsize,const struct bsdiff_opts *opts,struct bsdiff_output *out)
+{
+	return diff(idx,NULL,newbuf,newsize,opts,out);
+}
+
+int bsdiff_diff_bases(const struct bsdiff_index *idx,const off_t *sizes,
+    const int *use,int n,const unsigned char *newbuf,off_t newsize,
+    const struct bsdiff_opts *opts,struct bsdiff_output *out)
+{
+	struct runs r;
+	off_t pos,to;
+	int i,e;
+
+	for(i=0,pos=0;i<n;pos+=sizes[i++])
+		if((sizes[i]<0) || (sizes[i]>idx->oldsize-pos))
+			return BSDIFF_EINVAL;
+	if((n<1) || (pos!=idx->oldsize))
+		return BSDIFF_EINVAL;
+	if(((r.start=malloc(n*sizeof(off_t)))==NULL) ||
+	    ((r.end=malloc(n*sizeof(off_t)))==NULL) ||
+	    ((r.to=malloc(n*sizeof(off_t)))==NULL)) {
+		free(r.start);
+		free(r.end);
+		return BSDIFF_ENOMEM;
+	};
+
+	/* Join the used versions into runs, leaving out empty ones, which
+		neither use nor split */
+	r.n=0;
+	for(i=0,pos=0,to=0;i<n;pos+=sizes[i++]) {
+		if(!use[i] || (sizes[i]==0))
+			continue;
+		if((r.n>0) && (r.end[r.n-1]==pos)) {
+			r.end[r.n-1]+=sizes[i];
+		} else {
+			r.start[r.n]=pos;
+			r.end[r.n]=pos+sizes[i];
+			r.to[r.n]=to;
+			r.n++;
+		};
+		to+=sizes[i];
+	};
+	if(r.n==0) {
+		r.start[0]=r.end[0]=r.to[0]=0;
+		r.n=1;
+	};
+
+	/* Using all of old is a plain diff */
+	if((r.n==1) && (r.start[0]==0) && (r.end[0]==idx->oldsize))
+		e=diff(idx,NULL,newbuf,newsize,opts,out);
+	else
+		e=diff(idx,&r,newbuf,newsize,opts,out);
+
+	free(r.start);
+	free(r.end);
+	free(r.to);
+	return e;
+}
+
+int bsdiff_write(const struct bsdiff_triple *t,off_t nt,
+    const unsigned char *res,off_t newsize,const unsigned char *digest,
+    const struct bsdiff_opts *opts,struct bsdiff_output *out)
+{
+	struct bsdiff_opts defopts;
+	struct patchout po;
+	off_t flags,segsize,newpos,i;
+	int compact,e;
+
+	if(opts==NULL) {
+		memset(&defopts,0,sizeof(defopts));
+		opts=&defopts;
+	};
+	if((e=optsparse(opts,newsize,&flags,&compact,&segsize))!=0)
+		return e;
+	if(opts->selfref || (flags&BSDF_INPLACE) ||
+	    ((flags&BSDF_DIGEST) && (digest==NULL)))
+		return BSDIFF_EINVAL;
+
+	if(pobegin(&po,flags,compact,segsize,newsize,digest,out)==0) {
+		/* Without old, emit() takes the diff bytes from res as
+			they are */
+		po.new=(u_char *)res;
+		if((nt>0) && (t[0].oldpos!=0))
+			emit(&po,0,0,0,0,t[0].oldpos);
+		for(newpos=0,i=0;(i<nt)&&(po.err==0);i++) {
+			if((t[i].lenf<0) || (t[i].extra<0) ||
+			    (t[i].lenf>newsize-newpos-t[i].extra)) {
+				po.err=BSDIFF_EINVAL;
+				break;
+			};
+			emit(&po,newpos,t[i].oldpos,t[i].lenf,t[i].extra,
+			    (i+1<nt)?t[i+1].oldpos-t[i].oldpos-t[i].lenf:0);
+			newpos+=t[i].lenf+t[i].extra;
+		};
+		if((po.err==0) && (newpos!=newsize))
+			po.err=BSDIFF_EINVAL;
+		poend(&po);
+	};
+	pofree(&po);
+
+	return po.err;
+}
+
+const char *bsdiff_strerror(int error)
+{
+	switch(error) {
+	case BSDIFF_OK:
+		return "Success";
+	case BSDIFF_ENOMEM:
+		return "Out of memory";
+	case BSDIFF_EIO:
+		return "I/O error";
+	case BSDIFF_EINVAL:
+		return "Invalid options";
+	case BSDIFF_ECORRUPT:
+		return "Corrupt index";
+	default:
+		return "Unknown error";
+	};
+}
@@ -0,0 +1,2256 @@
+/*-
+ * Copyright 2003-2005 Colin Percival
+ * Copyright 2026 The Android Open Source Project
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <bzlib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>    // android
+#include <sys/mman.h>
+
+#include "bsformat.h"
+#include "bspatch.h"
+#include "sha256.h"
+
+#define MIN(x,y) (((x)<(y)) ? (x) : (y))
+#define MAX(x,y) (((x)>(y)) ? (x) : (y))
+
+/* Size of a sequential input, which is not known until its end */
+#define OFF_MAX	((off_t)(~(u_int64_t)0>>1))
+
+static off_t offtin(u_char *buf)
+{
+	off_t y;
+
+	y=buf[7]&0x7F;
+	y=y*256;y+=buf[6];
+	y=y*256;y+=buf[5];
+	y=y*256;y+=buf[4];
+	y=y*256;y+=buf[3];
+	y=y*256;y+=buf[2];
+	y=y*256;y+=buf[1];
+	y=y*256;y+=buf[0];
+
+	if(buf[7]&0x80) y=-y;
+
+	return y;
+}
+
+static void offtout(off_t x,u_char *buf)
+{
+	off_t y;
+
+	if(x<0) y=-x; else y=x;
+
+		buf[0]=y%256;y-=buf[0];
+	y=y/256;buf[1]=y%256;y-=buf[1];
+	y=y/256;buf[2]=y%256;y-=buf[2];
+	y=y/256;buf[3]=y%256;y-=buf[3];
+	y=y/256;buf[4]=y%256;y-=buf[4];
+	y=y/256;buf[5]=y%256;y-=buf[5];
+	y=y/256;buf[6]=y%256;y-=buf[6];
+	y=y/256;buf[7]=y%256;
+
+	if(x<0) buf[7]|=0x80;
+}
+
+static int varintin(u_char *buf,u_char *end,u_int64_t *x)
+{
+	int n;
+
+	*x=0;
+	for(n=0;(buf+n<end)&&(n<VARINT_MAX);n++) {
+		*x|=(u_int64_t)(buf[n]&0x7F)<<(7*n);
+		if((buf[n]&0x80)==0) return n+1;
+	};
+
+	return 0;
+}
+
+static off_t unzigzag(u_int64_t x)
+{
+	return (off_t)(x>>1)^-(off_t)(x&1);
+}
+
+/* A decoded control operation; see bsformat.h.  Triples from formats
+	without BSDF_OPS are turned into an ADD, an INSERT and a SEEK */
+struct bsop {
+	int op;
+	off_t len,arg;
+};
+
+/* Cursor over the control block, or over its three columns */
+struct ctrlcur {
+	u_char *p[3],*end[3];
+	int ncol,compact;
+};
+
+/* Read the next value for field i (0-2) of the control data */
+static int ctrlfield(struct ctrlcur *c,int i,u_int64_t *x)
+{
+	int j,k;
+
+	j=(c->ncol==3)?i:0;
+	if(c->compact) {
+		if((k=varintin(c->p[j],c->end[j],x))==0) return -1;
+		c->p[j]+=k;
+	} else {
+		if(c->end[j]-c->p[j]<8) return -1;
+		*x=offtin(c->p[j]);
+		c->p[j]+=8;
+	};
+
+	return 0;
+}
+
+/* Parse a control block into operations; returns the number of
+	operations, or -1 if the block is malformed.  With ncol==3 the
+	fields come from three separate columns, otherwise they are
+	interleaved in col[0] */
+static off_t ctrlparse(u_char **col,off_t *collen,int ncol,off_t flags,
+	int compact,struct bsop *ops)
+{
+	struct ctrlcur c;
+	u_int64_t x,y,z;
+	off_t n;
+	int j;
+
+	c.ncol=ncol;
+	c.compact=compact;
+	for(j=0;j<ncol;j++) {
+		c.p[j]=col[j];
+		c.end[j]=col[j]+collen[j];
+	};
+	n=0;
+	while(c.p[0]<c.end[0]) {
+		if(!(flags&BSDF_OPS)) {
+			if(ctrlfield(&c,0,&x) || ctrlfield(&c,1,&y) ||
+			    ctrlfield(&c,2,&z))
+				return -1;
+			ops[n].op=BSOP_ADD;ops[n].len=x;ops[n].arg=0;
+			ops[n+1].op=BSOP_INSERT;ops[n+1].len=y;ops[n+1].arg=0;
+			ops[n+2].op=BSOP_SEEK;ops[n+2].len=0;
+			ops[n+2].arg=compact?unzigzag(z):(off_t)z;
+			if((ops[n].len<0) || (ops[n+1].len<0)) return -1;
+			n+=3;
+			continue;
+		};
+
+		if(ctrlfield(&c,0,&x)) return -1;
+		ops[n].op=x&((1<<BSOP_BITS)-1);
+		ops[n].len=x>>BSOP_BITS;
+		ops[n].arg=0;
+		switch(ops[n].op) {
+		case BSOP_ADD:
+		case BSOP_COPY:
+		case BSOP_INSERT:
+			break;
+		case BSOP_FILL:
+			if(ctrlfield(&c,1,&y) || (y>0xFF)) return -1;
+			ops[n].arg=y;
+			break;
+		case BSOP_SEEK:
+			if(ctrlfield(&c,2,&z) || (ops[n].len!=0)) return -1;
+			ops[n].arg=unzigzag(z);
+			break;
+		case BSOP_COPYNEW:
+			if(ctrlfield(&c,1,&y) || (y==0) || ((off_t)y<0))
+				return -1;
+			ops[n].arg=y;
+			break;
+		default:
+			return -1;
+		};
+		n++;
+	};
+	for(j=1;j<ncol;j++)
+		if(c.p[j]!=c.end[j]) return -1;
+
+	return n;
+}
+
+/* Largest single callback read or write, and largest slice of input or
+	output handed to libbzip2 at once, whose counters are unsigned ints */
+#define IO_CHUNK	(256*1024*1024)
+#define BZ_CHUNK	(1024*1024*1024)
+
+/* How much of an input read through a callback is buffered at once */
+#define IN_BUF		(64*1024)
+
+/* Copy in[pos..pos+len) to buf */
+static int inread(const struct bspatch_input *in,off_t pos,u_char *buf,
+	off_t len)
+{
+	off_t n;
+
+	if((pos<0) || (len<0) || (pos>in->size) || (len>in->size-pos))
+		return BSPATCH_ECORRUPT;
+	if(in->buf!=NULL) {
+		memcpy(buf,in->buf+pos,len);
+		return 0;
+	};
+	for(;len>0;len-=n,pos+=n,buf+=n) {
+		n=MIN(len,IO_CHUNK);
+		if(in->read(in->opaque,pos,buf,n)!=0)
+			return BSPATCH_EIO;
+	};
+
+	return 0;
+}
+
+/* Decoder threads hand over decompressed data in RING_SLOTS buffers
+	of RING_SLOT bytes each */
+#define RING_SLOTS	4
+#define RING_SLOT	(256*1024)
+
+struct ring {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	u_char *slot[RING_SLOTS];
+	off_t slotlen[RING_SLOTS];
+	int head,count;		/* Oldest full slot, number of full slots */
+	off_t off;		/* Bytes of the head slot already consumed */
+	int done,stop;		/* Producer hit the end; consumer is closing */
+	int err;		/* Why the producer stopped early, if it did */
+};
+
+/* Buffered reader for one bzip2 stream, in[pos..pos+len) */
+struct stream {
+	bz_stream bz;
+	int init;		/* bz has been set up */
+	const struct bspatch_input *in;
+	off_t inpos,inleft;
+	u_char *inbuf;		/* NULL when in is a buffer */
+	int eof;
+	struct ring *ring;	/* NULL when decoding on the caller's thread */
+	u_char buf[4096];
+	int pos,len;
+	/* Sparse diff decoding state: bytes left in the current zero
+		run and literal run */
+	off_t zeros,lits;
+};
+
+/* Decompress up to len bytes into buf; returns fewer only at the end
+	of the stream, or an error */
+static off_t sdecompress(struct stream *s,u_char *buf,off_t len)
+{
+	off_t done,n;
+	int bz2err,e;
+
+	for(done=0;(done<len) && !s->eof;) {
+		if((s->bz.avail_in==0) && (s->inleft>0)) {
+			n=MIN(s->inleft,(s->inbuf!=NULL)?IN_BUF:BZ_CHUNK);
+			if(s->inbuf!=NULL) {
+				if((e=inread(s->in,s->inpos,s->inbuf,n))!=0)
+					return e;
+				s->bz.next_in=(char *)s->inbuf;
+			} else
+				s->bz.next_in=(char *)s->in->buf+s->inpos;
+			s->bz.avail_in=n;
+			s->inpos+=n;
+			s->inleft-=n;
+		};
+		s->bz.next_out=(char *)buf+done;
+		s->bz.avail_out=MIN(len-done,BZ_CHUNK);
+		bz2err=BZ2_bzDecompress(&s->bz);
+		if(bz2err==BZ_MEM_ERROR)
+			return BSPATCH_ENOMEM;
+		if((bz2err!=BZ_OK) && (bz2err!=BZ_STREAM_END))
+			return BSPATCH_ECORRUPT;
+		if(bz2err==BZ_STREAM_END)
+			s->eof=1;
+		else if((s->bz.next_out==(char *)buf+done) &&
+		    (s->bz.avail_in==0) && (s->inleft==0))
+			return BSPATCH_ECORRUPT;
+		done=(u_char *)s->bz.next_out-buf;
+	};
+
+	return done;
+}
+
+static void *sdecoder(void *arg)
+{
+	struct stream *s=arg;
+	struct ring *r=s->ring;
+	off_t n;
+	int slot;
+
+	for(;;) {
+		pthread_mutex_lock(&r->lock);
+		while((r->count==RING_SLOTS) && !r->stop)
+			pthread_cond_wait(&r->cond,&r->lock);
+		if(r->stop) {
+			pthread_mutex_unlock(&r->lock);
+			break;
+		};
+		slot=(r->head+r->count)%RING_SLOTS;
+		pthread_mutex_unlock(&r->lock);
+
+		/* Only this thread touches the slots that are not full */
+		n=sdecompress(s,r->slot[slot],RING_SLOT);
+
+		pthread_mutex_lock(&r->lock);
+		if(n<0) {
+			r->err=n;
+			r->done=1;
+		} else {
+			r->slotlen[slot]=n;
+			r->count++;
+			r->done=(n<RING_SLOT);
+		};
+		pthread_cond_signal(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+		if(r->done) break;
+	};
+
+	return NULL;
+}
+
+static void sclose(struct stream *s)
+{
+	struct ring *r=s->ring;
+	int i;
+
+	if(r!=NULL) {
+		pthread_mutex_lock(&r->lock);
+		r->stop=1;
+		pthread_cond_signal(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+		pthread_join(r->thread,NULL);
+		pthread_cond_destroy(&r->cond);
+		pthread_mutex_destroy(&r->lock);
+		for(i=0;i<RING_SLOTS;i++)
+			free(r->slot[i]);
+		free(r);
+		s->ring=NULL;
+	};
+	if(s->init)
+		BZ2_bzDecompressEnd(&s->bz);
+	s->init=0;
+	free(s->inbuf);
+	s->inbuf=NULL;
+}
+
+/* Set s up to read the bzip2 stream at in[pos..pos+len), on a thread
+	of its own if threaded is set; s must be closed even on failure */
+static int sopen(struct stream *s,const struct bspatch_input *in,
+	off_t pos,off_t len,int threaded)
+{
+	struct ring *r;
+	int bz2err,i;
+
+	memset(s,0,sizeof(*s));
+	s->in=in;s->inpos=pos;s->inleft=len;
+	if((in->buf==NULL) && ((s->inbuf=malloc(IN_BUF))==NULL))
+		return BSPATCH_ENOMEM;
+	if((bz2err=BZ2_bzDecompressInit(&s->bz,0,0))!=BZ_OK)
+		return (bz2err==BZ_MEM_ERROR)?BSPATCH_ENOMEM:BSPATCH_EINVAL;
+	s->init=1;
+	if(!threaded) return 0;
+
+	if((r=calloc(1,sizeof(*r)))==NULL)
+		return BSPATCH_ENOMEM;
+	for(i=0;i<RING_SLOTS;i++)
+		if((r->slot[i]=malloc(RING_SLOT))==NULL)
+			break;
+	if((i<RING_SLOTS) || (pthread_mutex_init(&r->lock,NULL)!=0)) {
+		while(i-->0)
+			free(r->slot[i]);
+		free(r);
+		return BSPATCH_ENOMEM;
+	};
+	if(pthread_cond_init(&r->cond,NULL)!=0) {
+		pthread_mutex_destroy(&r->lock);
+		for(i=0;i<RING_SLOTS;i++)
+			free(r->slot[i]);
+		free(r);
+		return BSPATCH_ENOMEM;
+	};
+	s->ring=r;
+	if(pthread_create(&r->thread,NULL,sdecoder,s)!=0) {
+		/* Decode on this thread after all */
+		pthread_cond_destroy(&r->cond);
+		pthread_mutex_destroy(&r->lock);
+		for(i=0;i<RING_SLOTS;i++)
+			free(r->slot[i]);
+		free(r);
+		s->ring=NULL;
+	};
+
+	return 0;
+}
+
+/* Like sdecompress, but takes the data from the decoder thread if
+	there is one */
+static off_t sfill(struct stream *s,u_char *buf,off_t len)
+{
+	struct ring *r=s->ring;
+	off_t done,n;
+
+	if(r==NULL)
+		return sdecompress(s,buf,len);
+
+	for(done=0;done<len;) {
+		pthread_mutex_lock(&r->lock);
+		while((r->count==0) && !r->done)
+			pthread_cond_wait(&r->cond,&r->lock);
+		n=r->count;
+		pthread_mutex_unlock(&r->lock);
+		if(n==0) {
+			if(r->err!=0) return r->err;
+			break;
+		};
+
+		n=MIN(len-done,r->slotlen[r->head]-r->off);
+		memcpy(buf+done,r->slot[r->head]+r->off,n);
+		done+=n;
+		r->off+=n;
+		if(r->off==r->slotlen[r->head]) {
+			pthread_mutex_lock(&r->lock);
+			r->head=(r->head+1)%RING_SLOTS;
+			r->count--;
+			r->off=0;
+			pthread_cond_signal(&r->cond);
+			pthread_mutex_unlock(&r->lock);
+		};
+	};
+
+	return done;
+}
+
+static int sread(struct stream *s,u_char *buf,off_t len)
+{
+	off_t n;
+
+	n=MIN(len,s->len-s->pos);
+	memcpy(buf,s->buf+s->pos,n);
+	s->pos+=n;buf+=n;len-=n;
+	if(len==0) return 0;
+
+	/* Large reads bypass the buffer */
+	if(len>=(off_t)sizeof(s->buf)) {
+		if((n=sfill(s,buf,len))<0) return n;
+		return (n<len)?BSPATCH_ECORRUPT:0;
+	};
+
+	if((n=sfill(s,s->buf,sizeof(s->buf)))<0) return n;
+	s->len=n;
+	s->pos=0;
+	if(s->len<len)
+		return BSPATCH_ECORRUPT;
+	memcpy(buf,s->buf,len);
+	s->pos=len;
+
+	return 0;
+}
+
+static int sreadlen(struct stream *s,off_t *xp)
+{
+	u_int64_t x;
+	u_char c;
+	int n,e;
+
+	x=0;
+	for(n=0;n<VARINT_MAX;n++) {
+		if((e=sread(s,&c,1))!=0) return e;
+		x|=(u_int64_t)(c&0x7F)<<(7*n);
+		if((c&0x80)==0) break;
+	};
+	if((n==VARINT_MAX) || ((off_t)x<0))
+		return BSPATCH_ECORRUPT;
+
+	*xp=x;
+	return 0;
+}
+
+/* Decompress the entire bzip2 stream at in[pos..pos+inlen) into a
+	malloc'd buffer */
+static int readbz2(const struct bspatch_input *in,off_t pos,off_t inlen,
+	u_char **bufp,off_t *lenp)
+{
+	struct stream s;
+	u_char *buf,*nbuf;
+	off_t len,size,n;
+	int e;
+
+	buf=NULL;len=0;size=0;
+	if((e=sopen(&s,in,pos,inlen,0))==0) {
+		do {
+			if(len==size) {
+				size=size*2+65536;
+				if((nbuf=realloc(buf,size))==NULL) {
+					e=BSPATCH_ENOMEM;
+					break;
+				};
+				buf=nbuf;
+			};
+			if((n=sdecompress(&s,buf+len,size-len))<0) {
+				e=n;
+				break;
+			};
+			len+=n;
+		} while(!s.eof);
+	};
+	sclose(&s);
+	if(e!=0) {
+		free(buf);
+		return e;
+	};
+
+	*bufp=buf;
+	*lenp=len;
+	return 0;
+}
+
+/* The old file, used where it is if it is a buffer and read through
+	a cache otherwise.  Each cache fill covers the range wanted plus as
+	much of what the next operations read as fits and is near enough,
+	so reads are few and cover little that is not used */
+struct oldfile {
+	const struct bspatch_input *in;
+	const u_char *buf;
+	off_t size;
+	u_char *cache;
+	off_t cachepos,cachelen;
+	/* The operations being applied, the one being applied now and
+		the old position it starts at */
+	struct bsop *ops;
+	off_t nops,cur,curpos;
+	long pagesize;
+	/* Read-ahead state for mapped files and for inputs that take
+		hints: the next operation to prefetch for and the old
+		position it reads from, the first operation not yet applied,
+		the number of old bytes prefetched for operations in between,
+		and a page range not yet advised */
+	int mapped,hint;
+	off_t ahead,aheadpos,done,pending;
+	off_t wlo,whi;
+};
+
+/* How far ahead of the apply loop to prefetch old data */
+#define OLD_READAHEAD	(4*1024*1024)
+
+/* Size of the cache, how much unused old data a fill may read to join
+	two ranges, and how many operations ahead to look for them */
+#define OLD_CACHE	(1024*1024)
+#define OLD_GAP		(32*1024)
+#define OLD_PLANOPS	1024
+
+static void oldinit(struct oldfile *of,const struct bspatch_input *in)
+{
+	memset(of,0,sizeof(*of));
+	of->in=in;
+	of->buf=in->buf;
+	of->size=in->size;
+	of->mapped=(in->buf!=NULL) && in->mapped;
+	of->hint=(in->buf==NULL) && (in->willneed!=NULL);
+	of->pagesize=sysconf(_SC_PAGESIZE);
+}
+
+/* Make dst a second handle on src's data, with state of its own, for
+	use by another thread */
+static void oldshare(struct oldfile *dst,struct oldfile *src)
+{
+	oldinit(dst,src->in);
+	dst->buf=src->buf;
+	dst->size=src->size;
+	dst->mapped=src->mapped;
+}
+
+static void oldfini(struct oldfile *of)
+{
+	free(of->cache);
+	of->cache=NULL;
+}
+
+/* Where a cache fill for old[pos..end) should stop: extend it over
+	the ranges the current and next operations read, in order, for as
+	long as each starts within OLD_GAP of the fill's end and the fill
+	fits in the cache.  Ranges the fill already covers are skipped */
+static off_t oldplan(struct oldfile *of,off_t pos,off_t end)
+{
+	off_t k,a,lo,hi,lim;
+
+	lim=MIN(pos+OLD_CACHE,of->size);
+	end=MIN(end,lim);
+	a=of->curpos;
+	for(k=of->cur;(k<of->nops)&&(k<of->cur+OLD_PLANOPS);k++) {
+		if(of->ops[k].op==BSOP_SEEK) {
+			a+=of->ops[k].arg;
+			continue;
+		};
+		if((of->ops[k].op!=BSOP_ADD) && (of->ops[k].op!=BSOP_COPY))
+			continue;
+		lo=MAX(a,0);
+		hi=MIN(a+of->ops[k].len,lim);
+		a+=of->ops[k].len;
+		if(hi<=end) continue;
+		if(lo>end+OLD_GAP) break;
+		end=hi;
+		if(end==lim) break;
+	};
+
+	return end;
+}
+
+/* Make old[pos..pos+len) available from the cache, where pos is
+	within old; returns how many bytes of it are at *p, or an error */
+static off_t oldfetch(struct oldfile *of,off_t pos,off_t len,
+	const u_char **p)
+{
+	int e;
+
+	if((pos<of->cachepos) || (pos>=of->cachepos+of->cachelen)) {
+		if((of->cache==NULL) &&
+		    ((of->cache=malloc(OLD_CACHE))==NULL))
+			return BSPATCH_ENOMEM;
+		of->cachepos=pos;
+		of->cachelen=oldplan(of,pos,pos+len)-pos;
+		if((e=inread(of->in,pos,of->cache,of->cachelen))!=0) {
+			of->cachelen=0;
+			return e;
+		};
+	};
+	*p=of->cache+(pos-of->cachepos);
+
+	return MIN(len,of->cachepos+of->cachelen-pos);
+}
+
+/* Add the bytes of old in [oldpos,oldpos+len) to buf; positions
+	outside old contribute nothing */
+static int addold(struct oldfile *of,u_char *buf,off_t oldpos,off_t len)
+{
+	const u_char *p;
+	off_t i,lo,hi,n;
+
+	lo=MAX(0,-oldpos);
+	hi=MIN(len,of->size-oldpos);
+	if(of->buf!=NULL) {
+		for(i=lo;i<hi;i++)
+			buf[i]+=of->buf[oldpos+i];
+		return 0;
+	};
+
+	for(;lo<hi;lo+=n) {
+		if((n=oldfetch(of,oldpos+lo,hi-lo,&p))<0) return n;
+		for(i=0;i<n;i++)
+			buf[lo+i]+=p[i];
+	};
+
+	return 0;
+}
+
+/* Like addold, but for a buffer known to be zero */
+static int copyold(struct oldfile *of,u_char *buf,off_t oldpos,off_t len)
+{
+	const u_char *p;
+	off_t lo,hi,n;
+
+	lo=MAX(0,-oldpos);
+	hi=MIN(len,of->size-oldpos);
+	memset(buf,0,len);
+	if(lo>=hi) return 0;
+	if(of->buf!=NULL) {
+		memcpy(buf+lo,of->buf+oldpos+lo,hi-lo);
+		return 0;
+	};
+
+	for(;lo<hi;lo+=n) {
+		if((n=oldfetch(of,oldpos+lo,hi-lo,&p))<0) return n;
+		memcpy(buf+lo,p,n);
+	};
+
+	return 0;
+}
+
+/* Let the kernel read ahead and drop behind if old is read more or
+	less front to back by ops, and leave prefetching entirely to
+	oldreadahead() otherwise */
+static void oldadvise(struct oldfile *of,struct bsop *ops,off_t nops)
+{
+	off_t i;
+	int seq;
+
+	if(!of->mapped) return;
+	seq=1;
+	for(i=0;i<nops;i++)
+		if((ops[i].op==BSOP_SEEK) && (ops[i].arg< -OLD_READAHEAD))
+			seq=0;
+	madvise((void *)of->buf,of->size,seq?MADV_SEQUENTIAL:MADV_RANDOM);
+}
+
+static void oldflushadvice(struct oldfile *of)
+{
+	if((of->wlo<of->whi) && of->mapped)
+		madvise((void *)(of->buf+of->wlo),of->whi-of->wlo,
+		    MADV_WILLNEED);
+	else if(of->wlo<of->whi)
+		of->in->willneed(of->in->opaque,of->wlo,of->whi-of->wlo);
+	of->wlo=of->whi=0;
+}
+
+/* Advise the kernel or the input that old[pos..pos+len) will be
+	needed soon, merging overlapping or adjacent ranges into one call */
+static void oldwillneed(struct oldfile *of,off_t pos,off_t len)
+{
+	off_t lo,hi;
+
+	lo=MAX(pos,0)&~(off_t)(of->pagesize-1);
+	hi=MIN(pos+len,of->size);
+	if(lo>=hi) return;
+	if((of->wlo<of->whi) && (lo<=of->whi) && (hi>=of->wlo)) {
+		of->wlo=MIN(of->wlo,lo);
+		of->whi=MAX(of->whi,hi);
+		return;
+	};
+	oldflushadvice(of);
+	of->wlo=lo;
+	of->whi=hi;
+}
+
+/* Called before applying ops[n], at old position oldpos: keep about
+	OLD_READAHEAD bytes of the old data that the following operations
+	will read on their way in */
+static void oldreadahead(struct oldfile *of,struct bsop *ops,off_t nops,
+	off_t n,off_t oldpos)
+{
+	of->ops=ops;
+	of->nops=nops;
+	of->cur=n;
+	of->curpos=oldpos;
+	if(!of->mapped && !of->hint) return;
+
+	for(;of->done<n;of->done++)
+		if((ops[of->done].op==BSOP_ADD) || (ops[of->done].op==BSOP_COPY))
+			of->pending-=ops[of->done].len;
+	if(of->ahead<=n) {
+		of->ahead=n;
+		of->aheadpos=oldpos;
+		of->pending=0;
+	};
+
+	for(;(of->ahead<nops) && (of->pending<OLD_READAHEAD);of->ahead++) {
+		switch(ops[of->ahead].op) {
+		case BSOP_ADD:
+		case BSOP_COPY:
+			oldwillneed(of,of->aheadpos,ops[of->ahead].len);
+			of->aheadpos+=ops[of->ahead].len;
+			of->pending+=ops[of->ahead].len;
+			break;
+		case BSOP_SEEK:
+			of->aheadpos+=ops[of->ahead].arg;
+			break;
+		};
+	};
+	oldflushadvice(of);
+}
+
+/* SHA-256 of data produced a window at a time, computed on a thread
+	of its own as the data is committed; the window is reused only once
+	the thread has caught up with it.  Without a thread, data is hashed
+	as it is committed */
+struct hasher {
+	struct bs_sha256 sha;
+	pthread_t thread;
+	int threaded;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	const u_char *buf;	/* The window */
+	off_t done,avail;	/* Bytes of it hashed, and ready to hash */
+	int stop;
+};
+
+/* How much newly committed data to gather before passing it on */
+#define HASH_STEP	(256*1024)
+
+static void *hashthread(void *arg)
+{
+	struct hasher *h=arg;
+	off_t done,avail;
+
+	for(;;) {
+		pthread_mutex_lock(&h->lock);
+		while((h->done==h->avail) && !h->stop)
+			pthread_cond_wait(&h->cond,&h->lock);
+		done=h->done;
+		avail=h->avail;
+		pthread_mutex_unlock(&h->lock);
+		if(done==avail) break;
+
+		bs_sha256_update(&h->sha,h->buf+done,avail-done);
+
+		pthread_mutex_lock(&h->lock);
+		h->done=avail;
+		pthread_cond_broadcast(&h->cond);
+		pthread_mutex_unlock(&h->lock);
+	};
+
+	return NULL;
+}
+
+/* Start hashing the data in the window at buf, carrying on from sha if
+	it is not NULL */
+static void hstart(struct hasher *h,const u_char *buf,
+	const struct bs_sha256 *sha)
+{
+	memset(h,0,sizeof(*h));
+	if(sha!=NULL)
+		h->sha=*sha;
+	else
+		bs_sha256_init(&h->sha);
+	h->buf=buf;
+	if(pthread_mutex_init(&h->lock,NULL)!=0)
+		return;
+	if(pthread_cond_init(&h->cond,NULL)!=0) {
+		pthread_mutex_destroy(&h->lock);
+		return;
+	};
+	if(pthread_create(&h->thread,NULL,hashthread,h)!=0) {
+		pthread_cond_destroy(&h->cond);
+		pthread_mutex_destroy(&h->lock);
+		return;
+	};
+	h->threaded=1;
+}
+
+/* The window's first avail bytes are ready */
+static void hput(struct hasher *h,off_t avail)
+{
+	if(!h->threaded) {
+		bs_sha256_update(&h->sha,h->buf+h->done,avail-h->done);
+		h->done=h->avail=avail;
+		return;
+	};
+	pthread_mutex_lock(&h->lock);
+	h->avail=avail;
+	pthread_cond_broadcast(&h->cond);
+	pthread_mutex_unlock(&h->lock);
+}
+
+/* Wait for all of the window to be hashed, and with reset start again
+	at the beginning of it */
+static void hwait(struct hasher *h,int reset)
+{
+	if(h->threaded) {
+		pthread_mutex_lock(&h->lock);
+		while(h->done<h->avail)
+			pthread_cond_wait(&h->cond,&h->lock);
+	};
+	if(reset)
+		h->done=h->avail=0;
+	if(h->threaded)
+		pthread_mutex_unlock(&h->lock);
+}
+
+/* Stop the thread and, if digest is not NULL, finish the hash */
+static void hfinish(struct hasher *h,u_char *digest)
+{
+	if(h->threaded) {
+		pthread_mutex_lock(&h->lock);
+		h->stop=1;
+		pthread_cond_broadcast(&h->cond);
+		pthread_mutex_unlock(&h->lock);
+		pthread_join(h->thread,NULL);
+		pthread_cond_destroy(&h->cond);
+		pthread_mutex_destroy(&h->lock);
+		h->threaded=0;
+	};
+	if(digest!=NULL)
+		bs_sha256_final(&h->sha,digest);
+}
+
+/* Checks old against its digest on a thread of its own, while the
+	patch is applied, so that a wrong old file is caught early */
+struct oldcheck {
+	pthread_t thread;
+	int threaded;
+	pthread_mutex_t lock;
+	const struct bspatch_input *in;
+	const u_char *digest;
+	int stop;
+	int result;		/* 1 while running, then 0 or an error */
+};
+
+/* How much of old to hash at a time */
+#define CHECK_CHUNK	(1024*1024)
+
+static void *checkthread(void *arg)
+{
+	struct oldcheck *oc=arg;
+	struct bs_sha256 sha;
+	u_char digest[SHA256_LEN],*buf;
+	off_t pos,n;
+	int e,stop;
+
+	buf=NULL;
+	if((oc->in->buf==NULL) && ((buf=malloc(CHECK_CHUNK))==NULL)) {
+		e=BSPATCH_ENOMEM;
+		goto done;
+	};
+	bs_sha256_init(&sha);
+	e=0;
+	for(pos=0;pos<oc->in->size;pos+=n) {
+		if(oc->threaded) {
+			pthread_mutex_lock(&oc->lock);
+			stop=oc->stop;
+			pthread_mutex_unlock(&oc->lock);
+			if(stop) break;
+		};
+		n=MIN(oc->in->size-pos,CHECK_CHUNK);
+		if(oc->in->buf!=NULL) {
+			bs_sha256_update(&sha,oc->in->buf+pos,n);
+			continue;
+		};
+		if((e=inread(oc->in,pos,buf,n))!=0) break;
+		bs_sha256_update(&sha,buf,n);
+	};
+	if((e==0) && (pos>=oc->in->size)) {
+		bs_sha256_final(&sha,digest);
+		if(memcmp(digest,oc->digest,SHA256_LEN)!=0)
+			e=BSPATCH_EOLD;
+	};
+	free(buf);
+
+done:
+	if(oc->threaded) pthread_mutex_lock(&oc->lock);
+	oc->result=e;
+	if(oc->threaded) pthread_mutex_unlock(&oc->lock);
+
+	return NULL;
+}
+
+/* Start checking in against digest, or check it now if no thread can
+	be had */
+static void ocstart(struct oldcheck *oc,const struct bspatch_input *in,
+	const u_char *digest)
+{
+	memset(oc,0,sizeof(*oc));
+	oc->in=in;
+	oc->digest=digest;
+	oc->result=1;
+	if(pthread_mutex_init(&oc->lock,NULL)==0) {
+		oc->threaded=1;
+		if(pthread_create(&oc->thread,NULL,checkthread,oc)==0)
+			return;
+		pthread_mutex_destroy(&oc->lock);
+		oc->threaded=0;
+	};
+	checkthread(oc);
+}
+
+/* The check's outcome so far: an error if it has failed, else 0 */
+static int ocpoll(struct oldcheck *oc)
+{
+	int result;
+
+	if(oc->threaded) pthread_mutex_lock(&oc->lock);
+	result=oc->result;
+	if(oc->threaded) pthread_mutex_unlock(&oc->lock);
+
+	return (result<0)?result:0;
+}
+
+/* Wait for the check to finish, or with abort stop it early, and
+	return its outcome */
+static int ocfinish(struct oldcheck *oc,int abort)
+{
+	if(oc->threaded) {
+		pthread_mutex_lock(&oc->lock);
+		oc->stop=abort;
+		pthread_mutex_unlock(&oc->lock);
+		pthread_join(oc->thread,NULL);
+		pthread_mutex_destroy(&oc->lock);
+		oc->threaded=0;
+	};
+
+	return oc->result;
+}
+
+/* The new file, reconstructed through a window of buf[size] holding
+	new[base..base+len).  The window is handed to the output's write()
+	whenever it fills up, unless it is the output's own buffer.  With
+	hash set, committed data is passed to it every HASH_STEP bytes,
+	and oc, if set, is polled as often.  The first error sticks in err
+	and stops newspace() handing out more of the window */
+struct newfile {
+	const struct bspatch_output *out;
+	u_char *buf;
+	off_t size,base,len;
+	int own;
+	struct hasher *hash;
+	struct oldcheck *oc;
+	off_t published;
+	int err;
+};
+
+static int newinit(struct newfile *nf,const struct bspatch_output *out,
+	off_t newsize,off_t window)
+{
+	nf->out=out;
+	nf->base=nf->len=0;
+	nf->hash=NULL;
+	nf->oc=NULL;
+	nf->published=0;
+	nf->err=0;
+	nf->own=(out->buf==NULL);
+	if(!nf->own) {
+		nf->buf=out->buf;
+		nf->size=newsize;
+		return 0;
+	};
+
+	/* Allocate size+1 bytes instead of size bytes to ensure
+		that we never try to malloc(0) and get a NULL pointer */
+	nf->size=((window>0) && (window<newsize))?window:newsize;
+	if((nf->buf=malloc(nf->size+1))==NULL)
+		return BSPATCH_ENOMEM;
+
+	return 0;
+}
+
+/* Pass what has been committed since last time to the hasher, and
+	see whether old has failed its check */
+static void newpublish(struct newfile *nf)
+{
+	if(nf->hash!=NULL)
+		hput(nf->hash,nf->len);
+	if((nf->oc!=NULL) && (nf->err==0))
+		nf->err=ocpoll(nf->oc);
+	nf->published=nf->len;
+}
+
+static int newflush(struct newfile *nf)
+{
+	off_t i,n;
+
+	newpublish(nf);
+	if(nf->err!=0) return nf->err;
+	if(nf->hash!=NULL)
+		hwait(nf->hash,1);
+	for(i=0;nf->own && (i<nf->len);i+=n) {
+		n=MIN(nf->len-i,IO_CHUNK);
+		if(nf->out->write(nf->out->opaque,nf->base+i,nf->buf+i,n)!=0)
+			return nf->err=BSPATCH_EIO;
+	};
+	nf->base+=nf->len;
+	nf->len=0;
+	nf->published=0;
+
+	return 0;
+}
+
+/* Hand everything committed so far to write(), or if the window is the
+	output's own buffer just wait for it to be hashed */
+static int newsync(struct newfile *nf)
+{
+	if(nf->own)
+		return newflush(nf);
+	newpublish(nf);
+	if(nf->hash!=NULL)
+		hwait(nf->hash,0);
+
+	return nf->err;
+}
+
+/* Return the free part of the window, flushing it first if it is
+	full, or NULL, leaving the reason in err, if that fails */
+static u_char *newspace(struct newfile *nf,off_t *avail)
+{
+	if(nf->err!=0) return NULL;
+	if((nf->len==nf->size) && (newflush(nf)!=0)) return NULL;
+	*avail=nf->size-nf->len;
+	return nf->buf+nf->len;
+}
+
+static void newcommit(struct newfile *nf,off_t len)
+{
+	nf->len+=len;
+	if(nf->len-nf->published>=HASH_STEP)
+		newpublish(nf);
+}
+
+/* Write out the rest and let go of the window */
+static int newfini(struct newfile *nf,int flush)
+{
+	int e;
+
+	e=flush?newflush(nf):0;
+	if(nf->own)
+		free(nf->buf);
+	nf->buf=NULL;
+
+	return e;
+}
+
+/* Fill buf, the next len bytes of the window, with the bytes starting
+	dist bytes before it.  The source may overlap buf, in which case
+	the copied bytes repeat, and may already have been written out */
+static int newcopy(struct newfile *nf,u_char *buf,off_t dist,off_t len)
+{
+	off_t pos,src,n;
+
+	pos=nf->base+nf->len;
+	while(len>0) {
+		src=pos-dist;
+		n=MIN(len,dist);
+		if(src>=nf->base) {
+			memcpy(buf,nf->buf+(src-nf->base),n);
+		} else {
+			n=MIN(n,nf->base-src);
+			if(nf->out->read==NULL)
+				return BSPATCH_EINVAL;
+			if(nf->out->read(nf->out->opaque,src,buf,n)!=0)
+				return BSPATCH_EIO;
+		};
+		buf+=n;pos+=n;len-=n;
+	};
+
+	return 0;
+}
+
+/* The control, diff and extra blocks of a whole patch or, with
+	BSDF_SEGMENTS, of one segment; the control block is decoded up
+	front and the other two as they are needed */
+struct body {
+	struct stream ds,es;
+	struct bsop *ops;
+	off_t nops;
+};
+
+/* Close a body, even one that bodyopen() failed on */
+static void bodyclose(struct body *b)
+{
+	/* Clean up the bzip2 reads */
+	sclose(&b->ds);
+	sclose(&b->es);
+	free(b->ops);
+	b->ops=NULL;
+}
+
+/* Open the body whose blocks are in[pos..pos+len), starting decoder
+	threads for the diff and then the extra block if threads allows */
+static int bodyopen(struct body *b,const struct bspatch_input *in,
+	off_t pos,off_t ctrllen,off_t datalen,off_t len,off_t flags,
+	int compact,int threads)
+{
+	off_t cboff[4],cblen[3],n;
+	u_char *cb[3],colheader[16];
+	int i,ncol,e;
+
+	memset(b,0,sizeof(*b));
+	if((ctrllen<0) || (datalen<0) || (ctrllen>len) ||
+	    (datalen>len-ctrllen))
+		return BSPATCH_ECORRUPT;
+
+	/* Locate the control block, or its three columns */
+	if (flags & BSDF_COLUMNS) {
+		if (ctrllen < 16)
+			return BSPATCH_ECORRUPT;
+		if ((e = inread(in, pos, colheader, 16)) != 0)
+			return e;
+		ncol = 3;
+		cboff[0] = 16;
+		for (i = 0; i < 2; i++) {
+			n = offtin(colheader + 8 * i);
+			if ((n < 0) || (n > ctrllen - cboff[i]))
+				return BSPATCH_ECORRUPT;
+			cboff[i + 1] = cboff[i] + n;
+		}
+	} else {
+		ncol = 1;
+		cboff[0] = 0;
+	}
+	cboff[ncol] = ctrllen;
+
+	/*
+	Decompress the diff and extra blocks straight out of the input.
+	With -j the first thread takes the diff block and the second the
+	extra block, so that they are decoded while the control block is
+	and then run ahead of the apply loop.
+	*/
+	if (((e = sopen(&b->ds, in, pos + ctrllen, datalen,
+	    threads >= 1)) != 0) ||
+	    ((e = sopen(&b->es, in, pos + ctrllen + datalen,
+	    len - ctrllen - datalen, threads >= 2)) != 0))
+		return e;
+
+	/* Decode the whole control block up front */
+	for (i = 0; i < ncol; i++)
+		cb[i] = NULL;
+	for (i = 0; (e == 0) && (i < ncol); i++)
+		e = readbz2(in, pos + cboff[i], cboff[i + 1] - cboff[i],
+		    &cb[i], &cblen[i]);
+	if (e == 0) {
+		n = 0;
+		for (i = 0; i < ncol; i++)
+			n += cblen[i];
+		if((b->ops=malloc(((compact?n:n/8)+3)*sizeof(*b->ops)))==NULL)
+			e=BSPATCH_ENOMEM;
+		else if((b->nops=ctrlparse(cb,cblen,ncol,flags,compact,
+		    b->ops))<0)
+			e=BSPATCH_ECORRUPT;
+	};
+	for (i = 0; i < ncol; i++)
+		free(cb[i]);
+
+	return e;
+}
+
+/* Reconstruct len bytes of new from old and a sparse diff stream */
+static int sparseadd(struct stream *s,u_char *new,struct oldfile *of,
+	off_t oldpos,off_t len)
+{
+	off_t n;
+	int e;
+
+	while(len>0) {
+		if((s->zeros==0) && (s->lits==0)) {
+			if(((e=sreadlen(s,&s->zeros))!=0) ||
+			    ((e=sreadlen(s,&s->lits))!=0))
+				return e;
+			continue;
+		};
+		if(s->zeros>0) {
+			n=MIN(len,s->zeros);
+			if((e=copyold(of,new,oldpos,n))!=0) return e;
+			s->zeros-=n;
+		} else {
+			n=MIN(len,s->lits);
+			if(((e=sread(s,new,n))!=0) ||
+			    ((e=addold(of,new,oldpos,n))!=0))
+				return e;
+			s->lits-=n;
+		};
+		new+=n;oldpos+=n;len-=n;
+	};
+
+	return 0;
+}
+
+/* Reconstruct newsize bytes into nf, starting at old position oldpos */
+static int bodyapply(struct body *b,off_t flags,struct oldfile *of,
+	struct newfile *nf,off_t oldpos,off_t newsize)
+{
+	struct bsop *ops=b->ops;
+	off_t newpos,len,k,n;
+	u_char *p;
+	int e;
+
+	newpos=0;
+	for(n=0;newpos<newsize;n++) {
+		/* Sanity-check */
+		if((n==b->nops) || (newpos+ops[n].len>newsize))
+			return BSPATCH_ECORRUPT;
+
+		oldreadahead(of,ops,b->nops,n,oldpos);
+
+		if(ops[n].op==BSOP_SEEK) {
+			oldpos+=ops[n].arg;
+			continue;
+		};
+		if((ops[n].op==BSOP_COPYNEW) && (ops[n].arg>newpos))
+			return BSPATCH_ECORRUPT;
+
+		/* Produce the operation's output a window at a time */
+		for(len=ops[n].len;len>0;len-=k) {
+			if((p=newspace(nf,&k))==NULL)
+				return nf->err;
+			k=MIN(k,len);
+			e=0;
+			switch(ops[n].op) {
+			case BSOP_ADD:
+				/* Read diff string and add old data to it */
+				if(flags&BSDF_SPARSE) {
+					e=sparseadd(&b->ds,p,of,oldpos,k);
+				} else if((e=sread(&b->ds,p,k))==0)
+					e=addold(of,p,oldpos,k);
+				oldpos+=k;
+				break;
+			case BSOP_COPY:
+				e=copyold(of,p,oldpos,k);
+				oldpos+=k;
+				break;
+			case BSOP_INSERT:
+				/* Read extra string */
+				e=sread(&b->es,p,k);
+				break;
+			case BSOP_FILL:
+				memset(p,ops[n].arg,k);
+				break;
+			case BSOP_COPYNEW:
+				e=newcopy(nf,p,ops[n].arg,k);
+				break;
+			};
+			if(e!=0) return e;
+			newcommit(nf,k);
+		};
+		newpos+=ops[n].len;
+	};
+
+	return 0;
+}
+
+/* A patch, checked and ready to apply */
+struct bspatch_ctx {
+	struct bspatch_input patch;
+	off_t flags,headerlen,newsize;
+	int compact;
+	off_t ctrllen,datalen;	/* Block lengths, without BSDF_SEGMENTS */
+	/* With BSDF_SEGMENTS: segment size and count, a copy of the
+		index, the application order within it for BSDF_INPLACE,
+		and where each segment's blocks start */
+	off_t segsize,nseg;
+	u_char *index,*order;
+	off_t *segoff;
+	u_char digest[BSDIGEST_LEN];	/* With BSDF_DIGEST: old's, new's */
+	u_char ident[SHA256_LEN];	/* Digest of header and index, to tie
+					   checkpoints to the patch */
+	int sequential;		/* A BSDF_STREAM patch yet to be read, whose
+				   index is spread through it */
+};
+
+/* Gather the index entries of a BSDF_STREAM patch, each of which comes
+	just before its segment's blocks */
+static int streamindex(struct bspatch_ctx *ctx)
+{
+	u_char *e;
+	off_t pos,seg,i,k;
+	int err;
+
+	pos=ctx->headerlen;
+	for(seg=0;seg<ctx->nseg;seg++) {
+		e=ctx->index+seg*BSSEG_ENTRYLEN;
+		if((err=inread(&ctx->patch,pos,e,BSSEG_ENTRYLEN))!=0)
+			return err;
+		pos+=BSSEG_ENTRYLEN;
+		ctx->segoff[seg]=pos;
+		for(i=1;i<4;i++) {
+			k=offtin(e+8*i);
+			if((k<0) || (k>ctx->patch.size-pos))
+				return BSPATCH_ECORRUPT;
+			pos+=k;
+		};
+	};
+	ctx->segoff[seg]=pos;
+
+	return 0;
+}
+
+int bspatch_open(struct bspatch_ctx **ctxp,const struct bspatch_input *patch)
+{
+	struct bspatch_ctx *ctx;
+	u_char header[BSDIFF41_HEADERLEN];
+	struct bs_sha256 sha;
+	off_t idxlen,seg,i,k;
+	char *seen;
+	int e;
+
+	/*
+	File format: see bsformat.h.  In short, a BSDIFF40 patch is
+		0	8	"BSDIFF40"
+		8	8	X
+		16	8	Y
+		24	8	sizeof(newfile)
+		32	X	bzip2(control block)
+		32+X	Y	bzip2(diff block)
+		32+X+Y	???	bzip2(extra block)
+	with control block a set of triples (x,y,z) meaning "add x bytes
+	from oldfile to x bytes from the diff block; copy y bytes from the
+	extra block; seek forwards in oldfile by z bytes".  BSDIFF41 adds
+	a flags word after the magic and stores the triples as varints,
+	or replaces them with a richer set of operations, and can cut
+	newfile into separately patched segments.
+	*/
+
+	if((ctx=calloc(1,sizeof(*ctx)))==NULL)
+		return BSPATCH_ENOMEM;
+	ctx->patch=*patch;
+	if(patch->sequential)
+		ctx->patch.size=OFF_MAX;
+	patch=&ctx->patch;
+
+	/* Read header */
+	if ((e = inread(patch, 0, header, BSDIFF40_HEADERLEN)) != 0)
+		goto fail;
+
+	/* Check for appropriate magic */
+	e = BSPATCH_ECORRUPT;
+	if (memcmp(header, BSDIFF40_MAGIC, 8) == 0) {
+		ctx->headerlen = BSDIFF40_HEADERLEN;
+		ctx->compact = 0;
+	} else if (memcmp(header, BSDIFF41_MAGIC, 8) == 0) {
+		ctx->headerlen = BSDIFF41_HEADERLEN;
+		ctx->compact = 1;
+		if ((e = inread(patch, BSDIFF40_HEADERLEN,
+		    header + BSDIFF40_HEADERLEN,
+		    BSDIFF41_HEADERLEN - BSDIFF40_HEADERLEN)) != 0)
+			goto fail;
+		ctx->flags = offtin(header + 8);
+		e = BSPATCH_EUNSUPPORTED;
+		if (ctx->flags & ~(off_t)BSDF_KNOWN)
+			goto fail;
+		e = BSPATCH_ECORRUPT;
+		if ((ctx->flags & (BSDF_INPLACE|BSDF_STREAM)) &&
+		    !(ctx->flags & BSDF_SEGMENTS))
+			goto fail;
+		if ((ctx->flags & BSDF_INPLACE) && (ctx->flags & BSDF_STREAM))
+			goto fail;
+	} else
+		goto fail;
+	e = BSPATCH_EINVAL;
+	if (patch->sequential && !(ctx->flags & BSDF_STREAM))
+		goto fail;
+	e = BSPATCH_ECORRUPT;
+
+	/* Read lengths from header */
+	ctx->ctrllen=offtin(header+ctx->headerlen-24);
+	ctx->datalen=offtin(header+ctx->headerlen-16);
+	ctx->newsize=offtin(header+ctx->headerlen-8);
+	if((ctx->ctrllen<0) || (ctx->datalen<0) || (ctx->newsize<0))
+		goto fail;
+
+	/* The digests follow the header; from here on headerlen is where
+		the rest of the patch starts */
+	if(ctx->flags&BSDF_DIGEST) {
+		if(patch->size<ctx->headerlen+BSDIGEST_LEN)
+			goto fail;
+		if((e=inread(patch,ctx->headerlen,ctx->digest,
+		    BSDIGEST_LEN))!=0)
+			goto fail;
+		e = BSPATCH_ECORRUPT;
+		ctx->headerlen+=BSDIGEST_LEN;
+	};
+	if(ctx->ctrllen>patch->size-ctx->headerlen)
+		goto fail;
+	if(!(ctx->flags&BSDF_SEGMENTS)) {
+		*ctxp=ctx;
+		return 0;
+	};
+
+	/* With BSDF_SEGMENTS the two lengths are those of the index and
+		of a segment */
+	idxlen=ctx->ctrllen;
+	ctx->segsize=ctx->datalen;
+	if((ctx->segsize==0) && (ctx->newsize>0))
+		goto fail;
+	ctx->nseg=(ctx->newsize>0)?(ctx->newsize-1)/ctx->segsize+1:0;
+	if((ctx->flags&BSDF_STREAM) && (idxlen!=0))
+		goto fail;
+	if(!(ctx->flags&BSDF_STREAM) && (idxlen!=ctx->nseg*(BSSEG_ENTRYLEN+
+	    ((ctx->flags&BSDF_INPLACE)?8:0))))
+		goto fail;
+
+	/* A stream is read as it is applied */
+	if((ctx->flags&BSDF_STREAM) && patch->sequential) {
+		ctx->sequential=1;
+		*ctxp=ctx;
+		return 0;
+	};
+
+	/* A stream's index is gathered from in front of each segment,
+		and the other patches' index says where each segment's
+		blocks start */
+	e = BSPATCH_ENOMEM;
+	if(ctx->flags&BSDF_STREAM)
+		idxlen=ctx->nseg*BSSEG_ENTRYLEN;
+	if(((ctx->index=malloc(idxlen+1))==NULL) ||
+	    ((ctx->segoff=malloc((ctx->nseg+1)*sizeof(off_t)))==NULL))
+		goto fail;
+	ctx->order=ctx->index+ctx->nseg*BSSEG_ENTRYLEN;
+	if(ctx->flags&BSDF_STREAM) {
+		if((e=streamindex(ctx))!=0)
+			goto fail;
+	} else {
+		if((e=inread(patch,ctx->headerlen,ctx->index,idxlen))!=0)
+			goto fail;
+		e = BSPATCH_ECORRUPT;
+		ctx->segoff[0]=ctx->headerlen+idxlen;
+		for(seg=0;seg<ctx->nseg;seg++) {
+			ctx->segoff[seg+1]=ctx->segoff[seg];
+			for(i=1;i<4;i++) {
+				k=offtin(ctx->index+seg*BSSEG_ENTRYLEN+8*i);
+				if((k<0) ||
+				    (k>patch->size-ctx->segoff[seg+1]))
+					goto fail;
+				ctx->segoff[seg+1]+=k;
+			};
+		};
+	};
+
+	bs_sha256_init(&sha);
+	bs_sha256_update(&sha,header,BSDIFF41_HEADERLEN);
+	if(ctx->flags&BSDF_DIGEST)
+		bs_sha256_update(&sha,ctx->digest,BSDIGEST_LEN);
+	bs_sha256_update(&sha,ctx->index,idxlen);
+	bs_sha256_final(&sha,ctx->ident);
+
+	/* Check that the in-place order names every segment once */
+	if(ctx->flags&BSDF_INPLACE) {
+		if((seen=calloc(ctx->nseg+1,1))==NULL) {
+			e=BSPATCH_ENOMEM;
+			goto fail;
+		};
+		for(i=0;i<ctx->nseg;i++) {
+			seg=offtin(ctx->order+8*i);
+			if((seg<0) || (seg>=ctx->nseg) || seen[seg])
+				break;
+			seen[seg]=1;
+		};
+		free(seen);
+		if(i<ctx->nseg)
+			goto fail;
+	};
+
+	*ctxp=ctx;
+	return 0;
+
+fail:
+	bspatch_close(ctx);
+	return e;
+}
+
+void bspatch_close(struct bspatch_ctx *ctx)
+{
+	if(ctx==NULL) return;
+	free(ctx->index);
+	free(ctx->segoff);
+	free(ctx);
+}
+
+off_t bspatch_newsize(const struct bspatch_ctx *ctx)
+{
+	return ctx->newsize;
+}
+
+off_t bspatch_flags(const struct bspatch_ctx *ctx)
+{
+	return ctx->flags;
+}
+
+const unsigned char *bspatch_digest(const struct bspatch_ctx *ctx)
+{
+	return (ctx->flags&BSDF_DIGEST)?ctx->digest:NULL;
+}
+
+/*
+Checkpoint state, BSPATCH_STATELEN bytes:
+	0	8	"BSSTATE1"
+	8	32	ctx->ident
+	40	8	pos, the segment boundary new is complete up to
+	48	8	1 if new[0..pos) has been hashed, else 0
+	56	32	the hash's words, most significant byte first
+	88	8	bytes hashed
+	96	64	the hash's partial block
+*/
+static void statesave(const struct bspatch_ctx *ctx,off_t pos,
+	const struct bs_sha256 *sha,u_char *state)
+{
+	int i;
+
+	memset(state,0,BSPATCH_STATELEN);
+	memcpy(state,"BSSTATE1",8);
+	memcpy(state+8,ctx->ident,SHA256_LEN);
+	offtout(pos,state+40);
+	if(sha==NULL) return;
+	offtout(1,state+48);
+	for(i=0;i<8;i++) {
+		state[56+4*i]=sha->h[i]>>24;
+		state[56+4*i+1]=sha->h[i]>>16;
+		state[56+4*i+2]=sha->h[i]>>8;
+		state[56+4*i+3]=sha->h[i];
+	};
+	offtout(sha->len,state+88);
+	memcpy(state+96,sha->buf,64);
+}
+
+/* Check that state belongs to the patch and return where it leaves
+	off, and in sha, if it has one, the hash of new up to there */
+static int stateload(const struct bspatch_ctx *ctx,const u_char *state,
+	off_t *pos,struct bs_sha256 *sha,int *hashed)
+{
+	u_char *p=(u_char *)state;
+	int i;
+
+	if(!(ctx->flags&BSDF_SEGMENTS) || ctx->sequential)
+		return BSPATCH_EINVAL;
+	*pos=offtin(p+40);
+	*hashed=(offtin(p+48)==1);
+	if((memcmp(p,"BSSTATE1",8)!=0) ||
+	    (memcmp(p+8,ctx->ident,SHA256_LEN)!=0) ||
+	    (*pos<0) || (*pos>ctx->newsize) ||
+	    ((*pos!=ctx->newsize) && (*pos%ctx->segsize!=0)) ||
+	    (*hashed && (offtin(p+88)!=*pos)))
+		return BSPATCH_ESTATE;
+	if(!*hashed) return 0;
+	for(i=0;i<8;i++)
+		sha->h[i]=((u_int32_t)p[56+4*i]<<24)|
+		    ((u_int32_t)p[56+4*i+1]<<16)|
+		    ((u_int32_t)p[56+4*i+2]<<8)|p[56+4*i+3];
+	sha->len=*pos;
+	memcpy(sha->buf,p+96,64);
+
+	return 0;
+}
+
+/* One segment of a BSDF_SEGMENTS patch, reconstructed into buf */
+struct segjob {
+	pthread_t thread;
+	const struct bspatch_ctx *ctx;
+	off_t seg;
+	struct oldfile *of;
+	u_char *buf;
+	off_t size;
+	int err;
+};
+
+static void *segapply(void *arg)
+{
+	struct segjob *j=arg;
+	const struct bspatch_ctx *ctx=j->ctx;
+	struct bspatch_output out;
+	struct body b;
+	struct oldfile of;
+	struct newfile nf;
+	u_char *e;
+
+	e=ctx->index+j->seg*BSSEG_ENTRYLEN;
+	memset(&out,0,sizeof(out));
+	out.buf=j->buf;
+	oldshare(&of,j->of);
+	newinit(&nf,&out,j->size,0);
+	if((j->err=bodyopen(&b,&ctx->patch,ctx->segoff[j->seg],offtin(e+8),
+	    offtin(e+16),offtin(e+8)+offtin(e+16)+offtin(e+24),
+	    ctx->flags,1,0))==0)
+		j->err=bodyapply(&b,ctx->flags,&of,&nf,offtin(e),j->size);
+	bodyclose(&b);
+	newfini(&nf,0);
+	oldfini(&of);
+
+	return NULL;
+}
+
+/* Reconstruct new[lo..hi) into nf from the segments of the patch.  Up
+	to opts->threads segments are applied at a time, each into a buffer
+	of its own unless it can go straight into the output's, and the
+	parts of them in range are written out in order.  Checkpoints are
+	taken between one batch of segments and the next */
+static int segsapply(const struct bspatch_ctx *ctx,struct oldfile *of,
+	struct newfile *nf,const struct bspatch_opts *opts,off_t lo,off_t hi)
+{
+	struct segjob *jobs;
+	u_char *segbuf,*p,state[BSPATCH_STATELEN];
+	off_t segsize,seg,first,last,segpos,pos,len,k,i,n,started,ckpt;
+	int threads,njobs,e;
+
+	threads=opts->threads;
+	segsize=ctx->segsize;
+	ckpt=lo;
+	njobs=MAX(threads,1);
+	if((jobs=calloc(njobs,sizeof(*jobs)))==NULL)
+		return BSPATCH_ENOMEM;
+	if((segbuf=malloc(njobs*MIN(segsize,ctx->newsize)+1))==NULL) {
+		free(jobs);
+		return BSPATCH_ENOMEM;
+	};
+	e=0;
+	first=lo/MAX(segsize,1);
+	last=(hi>lo)?(hi-1)/segsize+1:first;
+	for(seg=first;(e==0)&&(seg<last);seg+=n) {
+		n=MIN(njobs,last-seg);
+		for(i=0;i<n;i++) {
+			segpos=(seg+i)*segsize;
+			jobs[i].ctx=ctx;
+			jobs[i].seg=seg+i;
+			jobs[i].of=of;
+			jobs[i].size=MIN(segsize,ctx->newsize-segpos);
+			jobs[i].err=0;
+			if(!nf->own && (segpos>=lo) &&
+			    (segpos+jobs[i].size<=hi))
+				jobs[i].buf=nf->buf+(segpos-lo);
+			else
+				jobs[i].buf=segbuf+i*MIN(segsize,ctx->newsize);
+		};
+
+		if(threads==0) {
+			segapply(&jobs[0]);
+		} else {
+			for(started=0;started<n;started++)
+				if(pthread_create(&jobs[started].thread,NULL,
+				    segapply,&jobs[started])!=0)
+					break;
+			for(i=0;i<started;i++)
+				pthread_join(jobs[i].thread,NULL);
+			if(started<n) e=BSPATCH_ETHREAD;
+		};
+		for(i=0;(e==0)&&(i<n);i++)
+			e=jobs[i].err;
+
+		for(i=0;(e==0)&&(i<n);i++) {
+			segpos=(seg+i)*segsize;
+			pos=MAX(lo,segpos);
+			len=MIN(hi,segpos+jobs[i].size)-pos;
+			if(jobs[i].buf!=segbuf+i*MIN(segsize,ctx->newsize)) {
+				/* Already in place */
+				newcommit(nf,len);
+				continue;
+			};
+			for(;len>0;len-=k,pos+=k) {
+				if((p=newspace(nf,&k))==NULL) {
+					e=nf->err;
+					break;
+				};
+				k=MIN(k,len);
+				memcpy(p,jobs[i].buf+(pos-segpos),k);
+				newcommit(nf,k);
+			};
+		};
+
+		/* Everything before the next segment is done */
+		pos=(seg+n)*segsize;
+		if((e==0) && (opts->checkpoint!=NULL) && (seg+n<last) &&
+		    (pos-ckpt>=opts->ckptbytes)) {
+			if((e=newsync(nf))!=0) break;
+			statesave(ctx,pos,(nf->hash!=NULL)?&nf->hash->sha:NULL,
+			    state);
+			if(opts->checkpoint(opts->ckptopaque,state)!=0) {
+				e=BSPATCH_EIO;
+				break;
+			};
+			ckpt=pos;
+		};
+	};
+
+	free(segbuf);
+	free(jobs);
+
+	return e;
+}
+
+/* Reconstruct new into nf from a BSDF_STREAM patch that is read front
+	to back: each segment's index entry, then its blocks, which are
+	read into memory whole and applied straight into nf.  Each segment
+	reads old through a handle of its own, as in segsapply(), since its
+	operations start afresh */
+static int streamapply(const struct bspatch_ctx *ctx,struct oldfile *of,
+	struct newfile *nf,int threads)
+{
+	struct bspatch_input in;
+	struct body b;
+	struct oldfile sof;
+	u_char entry[BSSEG_ENTRYLEN],*frame,*nframe;
+	off_t pos,seg,len,size,k,i;
+	int e;
+
+	frame=NULL;
+	size=0;
+	e=0;
+	pos=ctx->headerlen;
+	for(seg=0;(e==0)&&(seg<ctx->nseg);seg++) {
+		if((e=inread(&ctx->patch,pos,entry,BSSEG_ENTRYLEN))!=0)
+			break;
+		pos+=BSSEG_ENTRYLEN;
+		for(len=0,i=1;i<4;i++) {
+			k=offtin(entry+8*i);
+			if((k<0) || (k>OFF_MAX-pos-len)) {
+				e=BSPATCH_ECORRUPT;
+				break;
+			};
+			len+=k;
+		};
+		if(e!=0) break;
+		if(len>=size) {
+			if((nframe=realloc(frame,len+1))==NULL) {
+				e=BSPATCH_ENOMEM;
+				break;
+			};
+			frame=nframe;
+			size=len+1;
+		};
+		if((e=inread(&ctx->patch,pos,frame,len))!=0)
+			break;
+		pos+=len;
+
+		memset(&in,0,sizeof(in));
+		in.buf=frame;
+		in.size=len;
+		if((e=bodyopen(&b,&in,0,offtin(entry+8),offtin(entry+16),len,
+		    ctx->flags,1,threads))==0) {
+			oldshare(&sof,of);
+			e=bodyapply(&b,ctx->flags,&sof,nf,offtin(entry),
+			    MIN(ctx->segsize,ctx->newsize-seg*ctx->segsize));
+			oldfini(&sof);
+		};
+		bodyclose(&b);
+	};
+	free(frame);
+
+	return e;
+}
+
+int bspatch_apply(const struct bspatch_ctx *ctx,
+    const struct bspatch_input *old,const struct bspatch_output *new,
+    const struct bspatch_opts *opts)
+{
+	struct bspatch_opts defopts;
+	struct oldfile of;
+	struct newfile nf;
+	struct body b;
+	struct hasher h;
+	struct oldcheck oc;
+	struct bs_sha256 sha;
+	u_char digest[SHA256_LEN];
+	off_t lo,hi,pos;
+	int verifyold,verifynew,hashed,e,r;
+
+	if(opts==NULL) {
+		memset(&defopts,0,sizeof(defopts));
+		defopts.hi=-1;
+		opts=&defopts;
+	};
+	lo=opts->lo;
+	hi=(opts->hi<0)?ctx->newsize:opts->hi;
+	if((lo<0) || (lo>hi) || (hi>ctx->newsize) || (opts->threads<0))
+		return BSPATCH_EINVAL;
+	if((hi-lo<ctx->newsize) && !(ctx->flags&BSDF_SEGMENTS))
+		return BSPATCH_EINVAL;
+	if((opts->checkpoint!=NULL) && !(ctx->flags&BSDF_SEGMENTS))
+		return BSPATCH_EINVAL;
+	if(ctx->sequential && ((hi-lo<ctx->newsize) ||
+	    (opts->checkpoint!=NULL) || (opts->resume!=NULL)))
+		return BSPATCH_EINVAL;
+
+	/* A resumed apply carries on with the hash where it left off */
+	hashed=0;
+	if(opts->resume!=NULL) {
+		if((e=stateload(ctx,opts->resume,&pos,&sha,&hashed))!=0)
+			return e;
+		if((lo!=pos) || (hi!=ctx->newsize))
+			return BSPATCH_EINVAL;
+	};
+
+	verifyold=(ctx->flags&BSDF_DIGEST) &&
+	    !(opts->noverify&BSPATCH_NOVERIFY_OLD);
+	verifynew=(ctx->flags&BSDF_DIGEST) &&
+	    !(opts->noverify&BSPATCH_NOVERIFY_NEW) &&
+	    ((hi-lo==ctx->newsize) || hashed);
+
+	oldinit(&of,old);
+	if((e=newinit(&nf,new,hi-lo,opts->window))!=0)
+		return e;
+	if(verifynew) {
+		hstart(&h,nf.buf,hashed?&sha:NULL);
+		nf.hash=&h;
+	};
+	if(verifyold) {
+		ocstart(&oc,old,ctx->digest);
+		nf.oc=&oc;
+		nf.err=ocpoll(&oc);
+	};
+
+	if(nf.err!=0) {
+		/* Old has already failed its check */
+		e=nf.err;
+	} else if(ctx->sequential) {
+		e=streamapply(ctx,&of,&nf,opts->threads);
+	} else if(!(ctx->flags&BSDF_SEGMENTS)) {
+		if((e=bodyopen(&b,&ctx->patch,ctx->headerlen,ctx->ctrllen,
+		    ctx->datalen,ctx->patch.size-ctx->headerlen,ctx->flags,
+		    ctx->compact,opts->threads))==0) {
+			/* Now that the operations are known, choose how to
+				page old in */
+			oldadvise(&of,b.ops,b.nops);
+			e=bodyapply(&b,ctx->flags,&of,&nf,0,ctx->newsize);
+		};
+		bodyclose(&b);
+	} else
+		e=segsapply(ctx,&of,&nf,opts,lo,hi);
+
+	/* Write the rest of the new file, which also lets the hasher
+		catch up with it, then see how the checks went */
+	if(e==0)
+		e=newflush(&nf);
+	if(verifyold) {
+		r=ocfinish(&oc,e!=0);
+		if(e==0)
+			e=r;
+	};
+	if(verifynew) {
+		hfinish(&h,(e==0)?digest:NULL);
+		if((e==0) &&
+		    (memcmp(digest,ctx->digest+SHA256_LEN,SHA256_LEN)!=0))
+			e=BSPATCH_ENEW;
+	};
+	newfini(&nf,0);
+	oldfini(&of);
+
+	return e;
+}
+
+int bspatch_resume(const struct bspatch_ctx *ctx,const unsigned char *state,
+    off_t *pos)
+{
+	struct bs_sha256 sha;
+	int hashed;
+
+	return stateload(ctx,state,pos,&sha,&hashed);
+}
+
+/* Call run for each stretch of new in order, saying where it comes
+	from */
+int bspatch_runs(const struct bspatch_ctx *ctx,
+    int (*run)(void *opaque,const struct bspatch_run *r),void *opaque)
+{
+	struct bspatch_run r;
+	struct body b;
+	u_char *e;
+	off_t seg,nseg,start,end,oldpos,k;
+	int err;
+
+	if(ctx->sequential)
+		return BSPATCH_EINVAL;
+
+	/* Only the control data is decoded, a body at a time */
+	nseg=(ctx->flags&BSDF_SEGMENTS)?ctx->nseg:1;
+	r.newpos=0;
+	for(seg=0;seg<nseg;seg++) {
+		start=r.newpos;
+		if(ctx->flags&BSDF_SEGMENTS) {
+			e=ctx->index+seg*BSSEG_ENTRYLEN;
+			err=bodyopen(&b,&ctx->patch,ctx->segoff[seg],
+			    offtin(e+8),offtin(e+16),
+			    offtin(e+8)+offtin(e+16)+offtin(e+24),
+			    ctx->flags,1,0);
+			oldpos=offtin(e);
+			end=MIN(start+ctx->segsize,ctx->newsize);
+		} else {
+			err=bodyopen(&b,&ctx->patch,ctx->headerlen,ctx->ctrllen,
+			    ctx->datalen,ctx->patch.size-ctx->headerlen,
+			    ctx->flags,ctx->compact,0);
+			oldpos=0;
+			end=ctx->newsize;
+		};
+
+		for(k=0;(err==0)&&(r.newpos<end);k++) {
+			if((k==b.nops) || (b.ops[k].len>end-r.newpos)) {
+				err=BSPATCH_ECORRUPT;
+				break;
+			};
+			if(b.ops[k].op==BSOP_SEEK) {
+				oldpos+=b.ops[k].arg;
+				continue;
+			};
+			r.len=b.ops[k].len;
+			switch(b.ops[k].op) {
+			case BSOP_ADD:
+			case BSOP_COPY:
+				r.from=BSPATCH_RUN_OLD;
+				r.pos=oldpos;
+				oldpos+=r.len;
+				break;
+			case BSOP_COPYNEW:
+				if(b.ops[k].arg>r.newpos-start)
+					err=BSPATCH_ECORRUPT;
+				r.from=BSPATCH_RUN_NEW;
+				r.pos=r.newpos-b.ops[k].arg;
+				break;
+			default:
+				r.from=BSPATCH_RUN_PATCH;
+				r.pos=0;
+			};
+			if((err==0) && (r.len>0) && (run(opaque,&r)!=0))
+				err=BSPATCH_EIO;
+			r.newpos+=r.len;
+		};
+		bodyclose(&b);
+		if(err!=0)
+			return err;
+	};
+
+	return 0;
+}
+
+/* Check buf[0..len) against digest */
+static int checkdigest(const u_char *buf,off_t len,const u_char *digest)
+{
+	struct bs_sha256 sha;
+	u_char d[SHA256_LEN];
+
+	bs_sha256_init(&sha);
+	bs_sha256_update(&sha,buf,len);
+	bs_sha256_final(&sha,d);
+
+	return memcmp(d,digest,SHA256_LEN)==0;
+}
+
+/* Apply the segments in the order the patch gives, each built in a
+	buffer and then copied into place, so that only one segment's
+	worth of memory is needed besides buf */
+int bspatch_inplace(const struct bspatch_ctx *ctx,unsigned char *buf,
+    off_t oldsize)
+{
+	struct bspatch_input in;
+	struct oldfile of;
+	struct segjob job;
+	off_t i;
+
+	if(!(ctx->flags&BSDF_INPLACE))
+		return BSPATCH_EINVAL;
+	if((ctx->flags&BSDF_DIGEST) &&
+	    !checkdigest(buf,oldsize,ctx->digest))
+		return BSPATCH_EOLD;
+
+	memset(&in,0,sizeof(in));
+	in.buf=buf;
+	in.size=oldsize;
+	oldinit(&of,&in);
+
+	memset(&job,0,sizeof(job));
+	if((job.buf=malloc(MIN(ctx->segsize,ctx->newsize)+1))==NULL)
+		return BSPATCH_ENOMEM;
+	job.ctx=ctx;
+	job.of=&of;
+	for(i=0;(job.err==0)&&(i<ctx->nseg);i++) {
+		job.seg=offtin(ctx->order+8*i);
+		job.size=MIN(ctx->segsize,ctx->newsize-job.seg*ctx->segsize);
+		segapply(&job);
+		if(job.err==0)
+			memcpy(buf+job.seg*ctx->segsize,job.buf,job.size);
+	};
+	free(job.buf);
+
+	if((job.err==0) && (ctx->flags&BSDF_DIGEST) &&
+	    !checkdigest(buf,ctx->newsize,ctx->digest+SHA256_LEN))
+		return BSPATCH_ENEW;
+
+	return job.err;
+}
+
+/* Each version in the middle of a chain is made this much at a time */
+#define CHAIN_WINDOW	(4*1024*1024)
+
+/* A version in the middle of a chain, made by ctx from old and read by
+	the next patch through in.  With a segmented patch only the
+	segments around what is read are made, a window at a time;
+	otherwise the whole version is made up front and kept in buf.
+	The first error sticks in err, since read() can only fail */
+struct chainlink {
+	const struct bspatch_ctx *ctx;
+	const struct bspatch_input *old;
+	struct bspatch_input in;
+	pthread_mutex_t lock;
+	u_char *buf;
+	off_t size,lo,hi;	/* buf[size] holds new[lo..hi) */
+	int err;
+};
+
+static int chainread(void *opaque,off_t pos,u_char *buf,size_t len)
+{
+	struct chainlink *l=opaque;
+	struct bspatch_output out;
+	struct bspatch_opts opts;
+	off_t n;
+	int e;
+
+	pthread_mutex_lock(&l->lock);
+	for(;(len>0) && (l->err==0);pos+=n,buf+=n,len-=n) {
+		if((pos<l->lo) || (pos>=l->hi)) {
+			/* Make the window of segments starting with the one
+				that pos is in */
+			memset(&out,0,sizeof(out));
+			out.buf=l->buf;
+			memset(&opts,0,sizeof(opts));
+			opts.lo=pos-pos%l->ctx->segsize;
+			opts.hi=MIN(opts.lo+l->size,l->ctx->newsize);
+			opts.noverify=BSPATCH_NOVERIFY_OLD;
+			l->lo=l->hi=0;
+			if((l->err=bspatch_apply(l->ctx,l->old,&out,&opts))!=0)
+				break;
+			l->lo=opts.lo;
+			l->hi=opts.hi;
+		};
+		n=MIN((off_t)len,l->hi-pos);
+		memcpy(buf,l->buf+(pos-l->lo),n);
+	};
+	e=l->err;
+	pthread_mutex_unlock(&l->lock);
+
+	return (e==0)?0:-1;
+}
+
+/* Set l up to make ctx's new from old */
+static int chaininit(struct chainlink *l,const struct bspatch_ctx *ctx,
+	const struct bspatch_input *old)
+{
+	struct bspatch_output out;
+	struct bspatch_opts opts;
+	int e;
+
+	memset(l,0,sizeof(*l));
+	l->old=old;
+	if(ctx->sequential)
+		return BSPATCH_EINVAL;
+	if(pthread_mutex_init(&l->lock,NULL)!=0)
+		return BSPATCH_ETHREAD;
+
+	/* From here on chainfini() has a lock to destroy */
+	l->ctx=ctx;
+	l->in.size=ctx->newsize;
+
+	if(ctx->flags&BSDF_SEGMENTS) {
+		l->size=MAX(CHAIN_WINDOW/ctx->segsize,1)*ctx->segsize;
+		l->size=MIN(l->size,ctx->newsize);
+		l->in.read=chainread;
+		l->in.opaque=l;
+	} else
+		l->size=ctx->newsize;
+	if((l->buf=malloc(l->size+1))==NULL)
+		return BSPATCH_ENOMEM;
+	if(ctx->flags&BSDF_SEGMENTS)
+		return 0;
+
+	memset(&out,0,sizeof(out));
+	out.buf=l->buf;
+	memset(&opts,0,sizeof(opts));
+	opts.hi=-1;
+	opts.noverify=BSPATCH_NOVERIFY_OLD;
+	if((e=bspatch_apply(ctx,old,&out,&opts))!=0)
+		return e;
+	l->in.buf=l->buf;
+
+	return 0;
+}
+
+static void chainfini(struct chainlink *l)
+{
+	if(l->ctx==NULL) return;
+	pthread_mutex_destroy(&l->lock);
+	free(l->buf);
+}
+
+int bspatch_chain(const struct bspatch_ctx *const *ctxs,int n,
+    const struct bspatch_input *old,const struct bspatch_output *new,
+    const struct bspatch_opts *opts)
+{
+	struct bspatch_opts defopts,lastopts;
+	struct chainlink *links;
+	struct oldcheck oc;
+	const struct bspatch_input *in;
+	int verifyold,i,e,r;
+
+	if(n<1)
+		return BSPATCH_EINVAL;
+	if(opts==NULL) {
+		memset(&defopts,0,sizeof(defopts));
+		defopts.hi=-1;
+		opts=&defopts;
+	};
+	if(n==1)
+		return bspatch_apply(ctxs[0],old,new,opts);
+
+	/* Only the last patch can be read as it arrives */
+	for(i=0;i<n-1;i++)
+		if(ctxs[i]->sequential)
+			return BSPATCH_EINVAL;
+
+	/* Each patch must start from the version the one before it
+		makes, where both say what that is */
+	for(i=1;i<n;i++)
+		if((ctxs[i-1]->flags&ctxs[i]->flags&BSDF_DIGEST) &&
+		    (memcmp(ctxs[i-1]->digest+SHA256_LEN,ctxs[i]->digest,
+		    SHA256_LEN)!=0))
+			return BSPATCH_ECHAIN;
+
+	if((links=calloc(n-1,sizeof(*links)))==NULL)
+		return BSPATCH_ENOMEM;
+
+	/* Old is checked against the first patch while the chain runs;
+		the versions after it are only read in part, so each of
+		those is vouched for by the patch before it instead */
+	verifyold=(ctxs[0]->flags&BSDF_DIGEST) &&
+	    !(opts->noverify&BSPATCH_NOVERIFY_OLD);
+	if(verifyold)
+		ocstart(&oc,old,ctxs[0]->digest);
+
+	e=0;
+	in=old;
+	for(i=0;(e==0)&&(i<n-1);i++) {
+		e=chaininit(&links[i],ctxs[i],in);
+		in=&links[i].in;
+	};
+	if(e==0) {
+		lastopts=*opts;
+		lastopts.noverify|=BSPATCH_NOVERIFY_OLD;
+		e=bspatch_apply(ctxs[n-1],in,new,&lastopts);
+	};
+
+	/* A failed read in the middle of the chain has its own reason */
+	for(i=0;(e==BSPATCH_EIO)&&(i<n-1);i++)
+		if(links[i].err!=0)
+			e=links[i].err;
+	if(verifyold) {
+		r=ocfinish(&oc,e!=0);
+		if((e==0) || (r==BSPATCH_EOLD))
+			e=r;
+	};
+	for(i=0;i<n-1;i++)
+		chainfini(&links[i]);
+	free(links);
+
+	return e;
+}
+
+const char *bspatch_strerror(int error)
+{
+	switch(error) {
+	case BSPATCH_OK:
+		return "Success";
+	case BSPATCH_ECORRUPT:
+		return "Corrupt patch";
+	case BSPATCH_EUNSUPPORTED:
+		return "Unsupported patch flags";
+	case BSPATCH_ENOMEM:
+		return "Out of memory";
+	case BSPATCH_EIO:
+		return "I/O error";
+	case BSPATCH_EINVAL:
+		return "Options do not fit the patch";
+	case BSPATCH_ETHREAD:
+		return "Cannot start thread";
+	case BSPATCH_EOLD:
+		return "Old file does not match the patch";
+	case BSPATCH_ENEW:
+		return "New file does not match the patch";
+	case BSPATCH_ESTATE:
+		return "Checkpoint does not match the patch";
+	case BSPATCH_ECHAIN:
+		return "Patches do not follow on from each other";
+	default:
+		return "Unknown error";
+	};
+}
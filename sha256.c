@@ -0,0 +1,136 @@
+/*-
+ * Copyright 2026 The Android Open Source Project
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "sha256.h"
+
+static const u_int32_t K[64]={
+	0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,
+	0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+	0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,
+	0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+	0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,
+	0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+	0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,
+	0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+	0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,
+	0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+	0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,
+	0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+	0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,
+	0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+	0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,
+	0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2
+};
+
+#define ROR(x,n)	(((x)>>(n))|((x)<<(32-(n))))
+
+/* Hash nblocks 64-byte blocks starting at p */
+static void blocks(u_int32_t *h,const unsigned char *p,size_t nblocks)
+{
+	u_int32_t w[64],a,b,c,d,e,f,g,k,t1,t2;
+	int i;
+
+	for(;nblocks>0;nblocks--,p+=64) {
+		for(i=0;i<16;i++)
+			w[i]=((u_int32_t)p[4*i]<<24)|((u_int32_t)p[4*i+1]<<16)|
+			    ((u_int32_t)p[4*i+2]<<8)|p[4*i+3];
+		for(i=16;i<64;i++)
+			w[i]=w[i-16]+w[i-7]+
+			    (ROR(w[i-15],7)^ROR(w[i-15],18)^(w[i-15]>>3))+
+			    (ROR(w[i-2],17)^ROR(w[i-2],19)^(w[i-2]>>10));
+
+		a=h[0];b=h[1];c=h[2];d=h[3];
+		e=h[4];f=h[5];g=h[6];k=h[7];
+		for(i=0;i<64;i++) {
+			t1=k+(ROR(e,6)^ROR(e,11)^ROR(e,25))+((e&f)^(~e&g))+
+			    K[i]+w[i];
+			t2=(ROR(a,2)^ROR(a,13)^ROR(a,22))+
+			    ((a&b)^(a&c)^(b&c));
+			k=g;g=f;f=e;e=d+t1;
+			d=c;c=b;b=a;a=t1+t2;
+		};
+		h[0]+=a;h[1]+=b;h[2]+=c;h[3]+=d;
+		h[4]+=e;h[5]+=f;h[6]+=g;h[7]+=k;
+	};
+}
+
+void bs_sha256_init(struct bs_sha256 *s)
+{
+	s->h[0]=0x6a09e667;s->h[1]=0xbb67ae85;
+	s->h[2]=0x3c6ef372;s->h[3]=0xa54ff53a;
+	s->h[4]=0x510e527f;s->h[5]=0x9b05688c;
+	s->h[6]=0x1f83d9ab;s->h[7]=0x5be0cd19;
+	s->len=0;
+}
+
+void bs_sha256_update(struct bs_sha256 *s,const unsigned char *p,size_t len)
+{
+	size_t fill,n;
+
+	fill=s->len%64;
+	s->len+=len;
+
+	/* Complete a partial block first */
+	if(fill>0) {
+		n=(len<64-fill)?len:64-fill;
+		memcpy(s->buf+fill,p,n);
+		p+=n;len-=n;
+		if(fill+n<64) return;
+		blocks(s->h,s->buf,1);
+	};
+
+	/* Whole blocks straight from the input */
+	blocks(s->h,p,len/64);
+	p+=len&~(size_t)63;
+	memcpy(s->buf,p,len%64);
+}
+
+void bs_sha256_final(struct bs_sha256 *s,unsigned char *digest)
+{
+	unsigned char pad[72];
+	u_int64_t bits;
+	size_t n;
+	int i;
+
+	/* A one bit, zeros up to 56 bytes into a block, and the length
+		in bits */
+	bits=s->len*8;
+	n=(s->len%64<56)?56-s->len%64:120-s->len%64;
+	memset(pad,0,sizeof(pad));
+	pad[0]=0x80;
+	for(i=0;i<8;i++)
+		pad[n+i]=bits>>(56-8*i);
+	bs_sha256_update(s,pad,n+8);
+
+	for(i=0;i<8;i++) {
+		digest[4*i]=s->h[i]>>24;
+		digest[4*i+1]=s->h[i]>>16;
+		digest[4*i+2]=s->h[i]>>8;
+		digest[4*i+3]=s->h[i];
+	};
+}